@@ -56,6 +56,20 @@ matrix random_matrix(int rows, int cols, float s)
     return m;
 }
 
+// Make a matrix that uses existing storage, it will not be freed
+// float *data: storage for rows*cols floats
+// int rows, cols: size of matrix
+// returns: shallow matrix over data
+matrix view_matrix(float *data, int rows, int cols)
+{
+    matrix m;
+    m.rows = rows;
+    m.cols = cols;
+    m.shallow = 1;
+    m.data = data;
+    return m;
+}
+
 // Free memory associated with matrix
 // matrix m: matrix to be freed
 void free_matrix(matrix m)
@@ -118,10 +132,20 @@ void axpy_matrix(float a, matrix x, matrix y)
 matrix matmul(matrix a, matrix b)
 {
     matrix c = make_matrix(a.rows, b.cols);
+    matmul_into(a, b, c);
+    return c;
+}
+
+// Perform matrix multiplication c = a*b into existing storage
+// matrix a,b: operands
+// matrix c: result, overwritten, must not alias a or b
+void matmul_into(matrix a, matrix b, matrix c)
+{
     // TODO: 1.4 - Implement matrix multiplication. Make sure it's fast!
     // printf("a.cols:%d\n",a.cols);
     // printf("b.rows:%d\n",b.rows);
     assert(a.cols == b.rows);
+    assert(c.rows == a.rows && c.cols == b.cols);
 
     
     // for (int row = 0; row < c.rows; row++) {
@@ -188,7 +212,6 @@ matrix matmul(matrix a, matrix b)
     }
 
 
-    return c;
 }
 
 
@@ -229,106 +252,355 @@ void print_matrix(matrix m)
     printf("__|\n");
 }
 
-// Used for matrix inversion
-matrix augment_matrix(matrix m)
+// Panel width for the blocked factorizations, a FACTOR_BLOCK wide panel
+// of a few hundred rows stays in cache while the trailing matrix is updated
+#define FACTOR_BLOCK 32
+
+// Solve op(t) x = b for every column of b, in place
+// matrix t: n x n triangular matrix, the other triangle is not read
+// matrix b: n x m right hand sides, overwritten with x
+// int upper: 1 if t is upper triangular, 0 if lower
+// int transpose: 1 to solve with t^T instead of t
+// int unit: 1 to take the diagonal of t as all ones
+void triangular_solve(matrix t, matrix b, int upper, int transpose, int unit)
 {
-    int i,j;
-    matrix c = make_matrix(m.rows, m.cols*2);
-    for(i = 0; i < m.rows; ++i){
-        for(j = 0; j < m.cols; ++j){
-            c.data[i*c.cols + j] = m.data[i*m.cols + j];
+    assert(t.rows == t.cols && t.rows == b.rows);
+    int n = t.rows;
+    int m = b.cols;
+    int i, j, k;
+    // Lower or transposed upper runs top down, the other two bottom up.
+    // Either way each step is a row axpy on b.
+    int forward = (upper == transpose);
+    for(k = 0; k < n; ++k){
+        i = forward ? k : n-1-k;
+        float *bi = b.data + i*m;
+        int lo = forward ? 0 : i+1;
+        int hi = forward ? i : n;
+        int r;
+        for(r = lo; r < hi; ++r){
+            float tir = transpose ? t.data[r*n + i] : t.data[i*n + r];
+            if(tir == 0) continue;
+            float *br = b.data + r*m;
+            for(j = 0; j < m; ++j) bi[j] -= tir*br[j];
+        }
+        if(!unit){
+            float inv = 1.f/t.data[i*n + i];
+            for(j = 0; j < m; ++j) bi[j] *= inv;
         }
     }
-    for(j = 0; j < m.rows; ++j){
-        c.data[j*c.cols + j+m.cols] = 1;
-    }
-    return c;
 }
 
-// Invert matrix m
-matrix matrix_invert(matrix m)
+// Cholesky factorization a = l * l^T of a symmetric positive definite
+// matrix, in place. Only the lower triangle of a is read. Right looking
+// and blocked: each panel of FACTOR_BLOCK columns is factored, then the
+// lower trailing matrix takes one rank-FACTOR_BLOCK update made of
+// contiguous row dot products.
+// matrix a: n x n, lower triangle becomes l, upper triangle is zeroed
+// returns: 0 on success, -1 if a is not positive definite
+int cholesky_matrix(matrix a)
 {
-    int i, j, k;
-    //print_matrix(m);
-    matrix none = {0};
-    if(m.rows != m.cols){
-        fprintf(stderr, "Matrix not square\n");
-        return none;
+    assert(a.rows == a.cols);
+    int n = a.rows;
+    int i, j, k, t;
+    for(k = 0; k < n; k += FACTOR_BLOCK){
+        int kb = (n - k < FACTOR_BLOCK) ? n - k : FACTOR_BLOCK;
+        // Diagonal block and the panel below it, column by column
+        for(j = k; j < k+kb; ++j){
+            float *rj = a.data + j*n;
+            float d = rj[j];
+            for(t = k; t < j; ++t) d -= rj[t]*rj[t];
+            if(d <= 0) return -1;
+            d = sqrtf(d);
+            rj[j] = d;
+            float inv = 1.f/d;
+            for(i = j+1; i < n; ++i){
+                float *ri = a.data + i*n;
+                float s = ri[j];
+                for(t = k; t < j; ++t) s -= ri[t]*rj[t];
+                ri[j] = s*inv;
+            }
+        }
+        // Trailing update, lower triangle only
+        for(i = k+kb; i < n; ++i){
+            float *ri = a.data + i*n + k;
+            for(j = k+kb; j <= i; ++j){
+                float *rj = a.data + j*n + k;
+                float s = 0;
+                for(t = 0; t < kb; ++t) s += ri[t]*rj[t];
+                a.data[i*n + j] -= s;
+            }
+        }
     }
-    matrix c = augment_matrix(m);
-    //print_matrix(c);
-    float **cdata = calloc((int16_t)c.rows, sizeof(float *));
-    for(i = 0; i < c.rows; ++i){
-        cdata[i] = c.data + i*c.cols;
+    for(i = 0; i < n; ++i){
+        for(j = i+1; j < n; ++j) a.data[i*n + j] = 0;
     }
+    return 0;
+}
 
+// Solve (l * l^T) x = b in place
+// matrix l: n x n cholesky factor from cholesky_matrix
+// matrix b: n x m right hand sides, overwritten with x
+void cholesky_solve(matrix l, matrix b)
+{
+    triangular_solve(l, b, 0, 0, 0);
+    triangular_solve(l, b, 0, 1, 0);
+}
 
-    for(k = 0; k < c.rows; ++k){
-        float p = 0.;
-        int index = -1;
-        for(i = k; i < c.rows; ++i){
-            float val = fabs(cdata[i][k]);
-            if(val > p){
-                p = val;
-                index = i;
+// LU factorization p a = l u with partial pivoting, in place. Right
+// looking and blocked like cholesky_matrix: a panel of FACTOR_BLOCK
+// columns is factored with row swaps applied to whole rows, then the
+// block row of u is solved and the trailing matrix updated with row axpys.
+// matrix a: n x n, becomes u in the upper triangle and the unit lower
+//           triangle of l below the diagonal
+// int *pivot: n row swaps, row j was swapped with pivot[j] at step j
+// returns: 0 on success, -1 if a is singular
+int lu_matrix(matrix a, int *pivot)
+{
+    assert(a.rows == a.cols);
+    int n = a.rows;
+    int i, j, k, t;
+    for(k = 0; k < n; k += FACTOR_BLOCK){
+        int kb = (n - k < FACTOR_BLOCK) ? n - k : FACTOR_BLOCK;
+        int end = k + kb;
+        for(j = k; j < end; ++j){
+            int p = j;
+            float max = fabsf(a.data[j*n + j]);
+            for(i = j+1; i < n; ++i){
+                float v = fabsf(a.data[i*n + j]);
+                if(v > max){
+                    max = v;
+                    p = i;
+                }
+            }
+            if(max == 0) return -1;
+            pivot[j] = p;
+            if(p != j){
+                float *rj = a.data + j*n;
+                float *rp = a.data + p*n;
+                for(t = 0; t < n; ++t){
+                    float swap = rj[t];
+                    rj[t] = rp[t];
+                    rp[t] = swap;
+                }
+            }
+            float *rj = a.data + j*n;
+            float inv = 1.f/rj[j];
+            for(i = j+1; i < n; ++i){
+                float *ri = a.data + i*n;
+                float lij = ri[j]*inv;
+                ri[j] = lij;
+                for(t = j+1; t < end; ++t) ri[t] -= lij*rj[t];
             }
         }
-        if(index == -1){
-            fprintf(stderr, "Can't do it, sorry!\n");
-            free_matrix(c);
-            return none;
-        }
-
-        float *swap = cdata[index];
-        cdata[index] = cdata[k];
-        cdata[k] = swap;
-
-        float val = cdata[k][k];
-        cdata[k][k] = 1;
-        for(j = k+1; j < c.cols; ++j){
-            cdata[k][j] /= val;
+        if(end == n) break;
+        // Block row of u: u12 = l11^-1 a12
+        for(i = k+1; i < end; ++i){
+            float *ri = a.data + i*n;
+            for(t = k; t < i; ++t){
+                float lit = ri[t];
+                float *rt = a.data + t*n;
+                for(j = end; j < n; ++j) ri[j] -= lit*rt[j];
+            }
         }
-        for(i = k+1; i < c.rows; ++i){
-            float s = -cdata[i][k];
-            cdata[i][k] = 0;
-            for(j = k+1; j < c.cols; ++j){
-                cdata[i][j] +=  s*cdata[k][j];
+        // Trailing update a22 -= l21 u12
+        for(i = end; i < n; ++i){
+            float *ri = a.data + i*n;
+            for(t = k; t < end; ++t){
+                float lit = ri[t];
+                if(lit == 0) continue;
+                float *rt = a.data + t*n;
+                for(j = end; j < n; ++j) ri[j] -= lit*rt[j];
             }
         }
     }
-    for(k = c.rows-1; k > 0; --k){
-        for(i = 0; i < k; ++i){
-            float s = -cdata[i][k];
-            cdata[i][k] = 0;
-            for(j = k+1; j < c.cols; ++j){
-                cdata[i][j] += s*cdata[k][j];
-            }
+    return 0;
+}
+
+// Solve a x = b in place from the factors of lu_matrix
+// matrix lu: n x n factors from lu_matrix
+// int *pivot: row swaps from lu_matrix
+// matrix b: n x m right hand sides, overwritten with x
+void lu_solve(matrix lu, const int *pivot, matrix b)
+{
+    assert(lu.rows == b.rows);
+    int i, j;
+    for(i = 0; i < b.rows; ++i){
+        if(pivot[i] == i) continue;
+        float *ri = b.data + i*b.cols;
+        float *rp = b.data + pivot[i]*b.cols;
+        for(j = 0; j < b.cols; ++j){
+            float swap = ri[j];
+            ri[j] = rp[j];
+            rp[j] = swap;
         }
     }
-    //print_matrix(c);
+    triangular_solve(lu, b, 0, 0, 1);
+    triangular_solve(lu, b, 1, 0, 0);
+}
+
+// Invert matrix m by solving against the identity with its LU factors
+matrix matrix_invert(matrix m)
+{
+    matrix none = {0};
+    if(m.rows != m.cols){
+        fprintf(stderr, "Matrix not square\n");
+        return none;
+    }
+    int i;
+    matrix lu = copy_matrix(m);
+    int *pivot = calloc(m.rows, sizeof(int));
+    if(lu_matrix(lu, pivot)){
+        fprintf(stderr, "Can't do it, sorry!\n");
+        free_matrix(lu);
+        free(pivot);
+        return none;
+    }
     matrix inv = make_matrix(m.rows, m.cols);
-    for(i = 0; i < m.rows; ++i){
-        for(j = 0; j < m.cols; ++j){
-            inv.data[i*m.cols + j] = cdata[i][j+m.cols];
+    for(i = 0; i < m.rows; ++i) inv.data[i*m.cols + i] = 1;
+    lu_solve(lu, pivot, inv);
+    free_matrix(lu);
+    free(pivot);
+    return inv;
+}
+
+// Fill in the normal equations M^T M and M^T b without transposing M
+static void normal_equations(matrix M, matrix b, matrix a, matrix y)
+{
+    int n = M.cols;
+    int i, j, r;
+    memset(a.data, 0, n*n*sizeof(float));
+    memset(y.data, 0, n*b.cols*sizeof(float));
+    for(r = 0; r < M.rows; ++r){
+        float *mr = M.data + r*n;
+        float *br = b.data + r*b.cols;
+        for(i = 0; i < n; ++i){
+            float *ai = a.data + i*n;
+            for(j = 0; j <= i; ++j) ai[j] += mr[i]*mr[j];
+            float *yi = y.data + i*b.cols;
+            for(j = 0; j < b.cols; ++j) yi[j] += mr[i]*br[j];
         }
     }
-    free_matrix(c);
-    free(cdata);
-    //print_matrix(inv);
-    return inv;
+    for(i = 0; i < n; ++i){
+        for(j = i+1; j < n; ++j) a.data[i*n + j] = a.data[j*n + i];
+    }
 }
 
+// Least squares solution of M a = b from the normal equations. Cholesky
+// handles the usual full rank case, LU picks up nearly singular ones.
+// matrix M: rows x n
+// matrix b: rows x m
+// returns: n x m solution, empty matrix if M^T M is singular
 matrix solve_system(matrix M, matrix b)
 {
+    assert(M.rows == b.rows);
     matrix none = {0};
-    matrix Mt = transpose_matrix(M);
-    matrix MtM = matmul(Mt, M);
-    matrix MtMinv = matrix_invert(MtM);
-    if(!MtMinv.data) return none;
-    matrix Mdag = matmul(MtMinv, Mt);
-    matrix a = matmul(Mdag, b);
-    free_matrix(Mt); free_matrix(MtM); free_matrix(MtMinv); free_matrix(Mdag);
-    return a;
+    matrix a = make_matrix(M.cols, M.cols);
+    matrix x = make_matrix(M.cols, b.cols);
+    normal_equations(M, b, a, x);
+    if(cholesky_matrix(a) == 0){
+        cholesky_solve(a, x);
+        free_matrix(a);
+        return x;
+    }
+    normal_equations(M, b, a, x);
+    int *pivot = calloc(M.cols, sizeof(int));
+    int status = lu_matrix(a, pivot);
+    if(status == 0) lu_solve(a, pivot, x);
+    free(pivot);
+    free_matrix(a);
+    if(status){
+        free_matrix(x);
+        return none;
+    }
+    return x;
+}
+
+// Singular value decomposition a = u * diag(s) * v^T by one-sided Jacobi
+// rotations, computed in double
+// matrix a: rows x cols, left untouched
+// matrix *u: set to rows x k with orthonormal columns, k = min(rows, cols)
+// matrix *s: set to 1 x k singular values, descending
+// matrix *v: set to cols x k with orthonormal columns
+// returns: 0 on success, -1 if the rotations did not converge
+int svd_matrix(matrix a, matrix *u, matrix *s, matrix *v)
+{
+    if(a.rows < a.cols){
+        // a^T = v s u^T
+        matrix at = transpose_matrix(a);
+        int status = svd_matrix(at, v, s, u);
+        free_matrix(at);
+        return status;
+    }
+    int m = a.rows;
+    int n = a.cols;
+    int i, j, k, sweep;
+    double *x = calloc(m*n, sizeof(double));
+    double *y = calloc(n*n, sizeof(double));
+    for(i = 0; i < m*n; ++i) x[i] = a.data[i];
+    for(i = 0; i < n; ++i) y[i*n + i] = 1;
+
+    int rotated = 1;
+    for(sweep = 0; sweep < 60 && rotated; ++sweep){
+        rotated = 0;
+        for(j = 0; j < n; ++j){
+            for(k = j+1; k < n; ++k){
+                double alpha = 0, beta = 0, gamma = 0;
+                for(i = 0; i < m; ++i){
+                    double p = x[i*n + j];
+                    double q = x[i*n + k];
+                    alpha += p*p;
+                    beta += q*q;
+                    gamma += p*q;
+                }
+                if(fabs(gamma) <= 1e-15*sqrt(alpha*beta) || gamma == 0) continue;
+                rotated = 1;
+                double zeta = (beta - alpha)/(2*gamma);
+                double t = (zeta >= 0 ? 1 : -1)/(fabs(zeta) + sqrt(1 + zeta*zeta));
+                double c = 1/sqrt(1 + t*t);
+                double sn = c*t;
+                for(i = 0; i < m; ++i){
+                    double p = x[i*n + j];
+                    double q = x[i*n + k];
+                    x[i*n + j] = c*p - sn*q;
+                    x[i*n + k] = sn*p + c*q;
+                }
+                for(i = 0; i < n; ++i){
+                    double p = y[i*n + j];
+                    double q = y[i*n + k];
+                    y[i*n + j] = c*p - sn*q;
+                    y[i*n + k] = sn*p + c*q;
+                }
+            }
+        }
+    }
+
+    // Column norms are the singular values, pick them largest first
+    double *norm = calloc(n, sizeof(double));
+    int *order = calloc(n, sizeof(int));
+    for(j = 0; j < n; ++j){
+        for(i = 0; i < m; ++i) norm[j] += x[i*n + j]*x[i*n + j];
+        norm[j] = sqrt(norm[j]);
+        order[j] = j;
+    }
+    for(j = 1; j < n; ++j){
+        int o = order[j];
+        for(k = j; k > 0 && norm[order[k-1]] < norm[o]; --k) order[k] = order[k-1];
+        order[k] = o;
+    }
+    *u = make_matrix(m, n);
+    *s = make_matrix(1, n);
+    *v = make_matrix(n, n);
+    for(k = 0; k < n; ++k){
+        j = order[k];
+        s->data[k] = norm[j];
+        for(i = 0; i < m; ++i) u->data[i*n + k] = norm[j] > 0 ? x[i*n + j]/norm[j] : 0;
+        for(i = 0; i < n; ++i) v->data[i*n + k] = y[i*n + j];
+    }
+    free(x);
+    free(y);
+    free(norm);
+    free(order);
+    return rotated ? -1 : 0;
 }
 
 void write_matrix(matrix m, FILE *fp)
@@ -33,6 +33,12 @@ matrix make_matrix(int rows, int cols);
 // returns: matrix of rows x cols with elements in range [-s,s]
 matrix random_matrix(int rows, int cols, float s);
 
+// Make a matrix that uses existing storage, it will not be freed
+// float *data: storage for rows*cols floats
+// int rows, cols: size of matrix
+// returns: shallow matrix over data
+matrix view_matrix(float *data, int rows, int cols);
+
 // Free memory associated with matrix
 // matrix m: matrix to be freed
 void free_matrix(matrix m);
@@ -48,6 +54,11 @@ matrix copy_matrix(matrix m);
 // returns: new matrix that is the result
 matrix matmul(matrix a, matrix b);
 
+// Perform matrix multiplication c = a*b into existing storage
+// matrix a,b: operands
+// matrix c: result, overwritten, must not alias a or b
+void matmul_into(matrix a, matrix b, matrix c);
+
 // Perform the hammard product of two matrices (element-wise multiplication)
 // matrix a, b: operands
 // returns: result of hammard product
@@ -67,12 +78,56 @@ void scal_matrix(float s, matrix m);
 // Print a matrix
 void print_matrix(matrix m);
 
-// You won't need these
+// Least squares solution of M a = b
+// matrix M: system, one equation per row
+// matrix b: right hand sides, one per column
+// returns: solution, empty matrix if M^T M is singular
 matrix solve_system(matrix M, matrix b);
+
+// Invert a square matrix
+// matrix m: matrix to invert
+// returns: inverse, empty matrix if m is singular
 matrix matrix_invert(matrix m);
+
+// You won't need these
 matrix transpose_matrix(matrix m);
 void test_matrix();
 
+// Cholesky factorization a = l * l^T, in place
+// matrix a: symmetric positive definite matrix, becomes l
+// returns: 0 on success, -1 if a is not positive definite
+int cholesky_matrix(matrix a);
+
+// Solve (l * l^T) x = b in place
+// matrix l: factor from cholesky_matrix
+// matrix b: right hand sides, one per column, becomes x
+void cholesky_solve(matrix l, matrix b);
+
+// LU factorization with partial pivoting, in place
+// matrix a: square matrix, becomes the l and u factors
+// int *pivot: room for a.rows row swaps
+// returns: 0 on success, -1 if a is singular
+int lu_matrix(matrix a, int *pivot);
+
+// Solve a x = b in place from lu_matrix factors
+// matrix lu: factors from lu_matrix
+// int *pivot: row swaps from lu_matrix
+// matrix b: right hand sides, one per column, becomes x
+void lu_solve(matrix lu, const int *pivot, matrix b);
+
+// Solve op(t) x = b in place for triangular t
+// matrix t: triangular matrix
+// matrix b: right hand sides, one per column, becomes x
+// int upper, transpose, unit: which triangle, whether to use t^T, and
+//                             whether the diagonal is taken as ones
+void triangular_solve(matrix t, matrix b, int upper, int transpose, int unit);
+
+// Singular value decomposition a = u * diag(s) * v^T
+// matrix a: matrix to decompose
+// matrix *u, *s, *v: results, see svd_matrix in matrix.c
+// returns: 0 on success, -1 if it did not converge
+int svd_matrix(matrix a, matrix *u, matrix *s, matrix *v);
+
 void write_matrix(matrix m, FILE *fp);
 void read_matrix(matrix m, FILE *fp);
 matrix load_matrix(char *fname);
@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "uwnet.h"
+
+// Index of the layer that starts the last checkpointed segment, its state
+// and everything after it is saved by forward as usual
+int last_checkpoint(net m)
+{
+    int i;
+    if (!m.checkpoint) return 0;
+    for (i = m.n-1; i > 0; --i) {
+        if (m.checkpoint[i]) return i;
+    }
+    return 0;
+}
+
+// Release what a layer saved for backward
+void free_layer_state(layer l)
+{
+    if (l.x) {
+        free_matrix(*l.x);
+        *l.x = (matrix){0};
+    }
+    if (l.x_norm) {
+        free_matrix(*l.x_norm);
+        *l.x_norm = (matrix){0};
+    }
+}
+
+// Run the segment that layer i belongs to forward again from its
+// checkpoint, saving state for backward this time
+// net m: network being trained
+// int i: last layer of the segment that backward needs next
+// returns: index of the first layer of the segment
+int recompute_segment(net m, int i)
+{
+    int j = i;
+    while (j > 0 && !m.checkpoint[j]) --j;
+
+    int k;
+    matrix x = copy_matrix(m.saved[j]);
+    for (k = j; k <= i; ++k) {
+        layer l = m.layers[k];
+        l.recompute = 1;
+        matrix y = l.forward(l, x);
+        if (y.data != x.data) free_matrix(x);
+        x = y;
+    }
+    free_matrix(x);
+    return j;
+}
+
+// Bytes a layer saves for backward per example
+// layer l: layer to check
+// int inputs: number of inputs per example
+size_t layer_state_size(layer l, int inputs)
+{
+    if (l.inplace) {
+        if (l.activation == RELU || l.activation == LRELU) return (inputs + 7) / 8;
+        if (l.activation == LOGISTIC) return inputs*sizeof(float);
+        return 0;
+    }
+    return inputs*sizeof(float);
+}
+
+// Use the given checkpoints for training
+// net *m: network to configure
+// int *checkpoint: m->n flags, 1 to keep that layer's input during
+//                  forward; copied, layer 0 is always a checkpoint
+void set_checkpoints(net *m, int *checkpoint)
+{
+    int i;
+    clear_checkpoints(m);
+    m->checkpoint = calloc(m->n, sizeof(int));
+    m->saved = calloc(m->n, sizeof(matrix));
+    for (i = 0; i < m->n; ++i) {
+        m->checkpoint[i] = checkpoint[i];
+    }
+    m->checkpoint[0] = 1;
+}
+
+// Go back to keeping every layer's state during forward
+void clear_checkpoints(net *m)
+{
+    int i;
+    if (!m->checkpoint) return;
+    for (i = 0; i < m->n; ++i) {
+        free_matrix(m->saved[i]);
+    }
+    free(m->saved);
+    free(m->checkpoint);
+    m->saved = 0;
+    m->checkpoint = 0;
+}
+
+// Greedily split layers into segments whose saved state stays under cap
+// size_t *state: per-layer state size
+// size_t *input: per-layer input size
+// int *checkpoint: filled with the chosen segment starts
+// returns: peak bytes, checkpoints plus the largest segment, 0 if a single
+//          layer does not fit in cap
+size_t split_segments(size_t *state, size_t *input, int n, size_t cap, int *checkpoint)
+{
+    int i;
+    size_t segment = 0;
+    size_t largest = 0;
+    size_t kept = 0;
+    int start = 0;
+    for (i = 0; i < n; ++i) {
+        checkpoint[i] = (i == 0);
+        if (state[i] > cap) return 0;
+        if (segment + state[i] > cap) {
+            kept += input[start];
+            checkpoint[i] = 1;
+            start = i;
+            segment = 0;
+        }
+        segment += state[i];
+        if (segment > largest) largest = segment;
+    }
+    // The last segment is saved directly, its input needs no copy
+    return kept + largest;
+}
+
+// Pick activation checkpoints so training fits in a memory budget. Each
+// segment between checkpoints is recomputed once during backward_net.
+// net *m: network to configure
+// int batch: examples per forward pass
+// int inputs: inputs per example to the first layer
+// size_t budget: bytes available for saved activations
+// returns: 1 if the plan fits the budget, 0 if the leanest plan found
+//          still does not (it is used anyway)
+int plan_checkpoints(net *m, int batch, int inputs, size_t budget)
+{
+    int i, j;
+    int n = m->n;
+    size_t *state = calloc(n, sizeof(size_t));
+    size_t *input = calloc(n, sizeof(size_t));
+    int *plan = calloc(n, sizeof(int));
+    int *best = calloc(n, sizeof(int));
+    size_t total = 0;
+
+    int cols = inputs;
+    for (i = 0; i < n; ++i) {
+        state[i] = batch*layer_state_size(m->layers[i], cols);
+        input[i] = batch*cols*sizeof(float);
+        total += state[i];
+        cols = layer_outputs(m->layers[i], cols);
+    }
+
+    int fits = 1;
+    if (total <= budget) {
+        clear_checkpoints(m);
+    } else {
+        // Any segment cap worth trying is the state of some run of layers,
+        // take the largest one that fits, it needs the fewest checkpoints
+        size_t best_cap = 0;
+        size_t best_peak = 0;
+        for (i = 0; i < n; ++i) {
+            size_t cap = 0;
+            for (j = i; j < n; ++j) {
+                cap += state[j];
+                size_t peak = split_segments(state, input, n, cap, plan);
+                if (!peak) continue;
+                int better = best_peak == 0
+                    || (peak <= budget && (best_peak > budget || cap > best_cap))
+                    || (peak > budget && best_peak > budget && peak < best_peak);
+                if (better) {
+                    best_cap = cap;
+                    best_peak = peak;
+                }
+            }
+        }
+        split_segments(state, input, n, best_cap, best);
+        set_checkpoints(m, best);
+        fits = best_peak <= budget;
+    }
+
+    free(state);
+    free(input);
+    free(plan);
+    free(best);
+    return fits;
+}
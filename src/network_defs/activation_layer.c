@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
 #include "uwnet.h"
 
 
@@ -10,13 +11,16 @@
 // returns: the result of running the layer y = f(x)
 matrix forward_activation_layer(layer l, matrix x)
 {
-    // Saving our input
+    // Saving our input, unless backward will not need it from us
     // Probably don't change this
-    free_matrix(*l.x);
-    *l.x = copy_matrix(x);
+    if(!l.nosave){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(x);
+    }
 
     ACTIVATION a = l.activation;
-    matrix y = copy_matrix(x);
+    // y may be x itself when running without gradients
+    matrix y = l.out ? view_matrix(l.out, x.rows, x.cols) : make_matrix(x.rows, x.cols);
 
     // TODO: 2.1
     // apply the activation function to matrix y
@@ -38,6 +42,8 @@ matrix forward_activation_layer(layer l, matrix x)
                 y.data[index] = (v>0) ? v : .01*v;
             } else if (a == SOFTMAX){
                 y.data[index] = expf(v);
+            } else {
+                y.data[index] = v;
             }
             sum += y.data[index];
         }
@@ -77,7 +83,7 @@ matrix backward_activation_layer(layer l, matrix dy)
         for(j = 0; j < dx.cols; ++j){
             float v = x.data[i*x.cols + j];
             if(a == LOGISTIC){
-                float fx = 1/(1 + exp(-v));
+                float fx = 1/(1 + expf(-v));
                 dx.data[i*dx.cols + j] *= fx*(1-fx);
             } else if (a == RELU){
                 dx.data[i*dx.cols + j] *= (v>0) ? 1 : 0;
@@ -90,16 +96,111 @@ matrix backward_activation_layer(layer l, matrix dy)
     return dx;
 }
 
+// Make sure the mask can hold n bits and clear it
+// bitmask *m: mask to resize
+// int n: number of elements to track
+void reset_bitmask(bitmask *m, int n)
+{
+    int bytes = (n + 7) / 8;
+    if (m->n < n) {
+        free(m->bits);
+        m->bits = malloc(bytes);
+        m->n = n;
+    }
+    memset(m->bits, 0, bytes);
+}
+
+// Run an activation layer on input, overwriting it
+// layer l: pointer to layer to run
+// matrix x: input to layer, also stores result
+// returns: x, now holding y = f(x)
+matrix forward_activation_layer_inplace(layer l, matrix x)
+{
+    // Nothing to keep for backward, this is just a plain activation
+    if (l.inference) return forward_activation_layer(l, x);
+
+    ACTIVATION a = l.activation;
+    int n = x.rows*x.cols;
+    int i, j;
+
+    if (a == RELU || a == LRELU) {
+        // Only the sign of the input is needed for backward
+        if (l.nosave) {
+            for(i = 0; i < n; ++i){
+                float v = x.data[i];
+                if(v <= 0) x.data[i] = (a == RELU) ? 0 : .01f*v;
+            }
+            return x;
+        }
+        reset_bitmask(l.mask, n);
+        unsigned char *bits = l.mask->bits;
+        for(i = 0; i < n; ++i){
+            float v = x.data[i];
+            if(v > 0){
+                bits[i >> 3] |= 1 << (i & 7);
+            } else {
+                x.data[i] = (a == RELU) ? 0 : .01f*v;
+            }
+        }
+    } else if (a == LOGISTIC) {
+        for(i = 0; i < n; ++i){
+            x.data[i] = 1/(1+expf(-x.data[i]));
+        }
+        // Backward needs f(x), which we are about to hand to the next layer
+        if (!l.nosave) {
+            free_matrix(*l.x);
+            *l.x = copy_matrix(x);
+        }
+    } else if (a == SOFTMAX) {
+        for(i = 0; i < x.rows; ++i){
+            float *row = x.data + i*x.cols;
+            float sum = 0;
+            for(j = 0; j < x.cols; ++j){
+                row[j] = expf(row[j]);
+                sum += row[j];
+            }
+            for(j = 0; j < x.cols; ++j){
+                row[j] /= sum;
+            }
+        }
+    }
+    return x;
+}
+
+// Run an in-place activation layer backward
+// layer l: layer to run
+// matrix dy: derivative of loss wrt output, dL/dy, also stores result
+// returns: dy, now holding dL/dx
+matrix backward_activation_layer_inplace(layer l, matrix dy)
+{
+    ACTIVATION a = l.activation;
+    int n = dy.rows*dy.cols;
+    int i;
+
+    if (a == RELU || a == LRELU) {
+        float neg = (a == RELU) ? 0 : .01f;
+        unsigned char *bits = l.mask->bits;
+        for(i = 0; i < n; ++i){
+            if(!(bits[i >> 3] & (1 << (i & 7)))) dy.data[i] *= neg;
+        }
+    } else if (a == LOGISTIC) {
+        float *fx = l.x->data;
+        for(i = 0; i < n; ++i){
+            dy.data[i] *= fx[i]*(1-fx[i]);
+        }
+    }
+    return dy;
+}
+
 // Update activation layer..... nothing happens tho
 // layer l: layer to update
-// float rate: SGD learning rate
-// float momentum: SGD momentum term
-// float decay: l2 normalization term
-void update_activation_layer(layer l, float rate, float momentum, float decay){}
+// optimizer *o: update rule
+void update_activation_layer(layer l, optimizer *o){}
 
 layer make_activation_layer(ACTIVATION a)
 {
     layer l = {0};
+    l.type = ACTIVATION_LAYER;
     l.activation = a;
     l.x = calloc(1, sizeof(matrix));
     l.forward = forward_activation_layer;
@@ -107,3 +208,15 @@ layer make_activation_layer(ACTIVATION a)
     l.update = update_activation_layer;
     return l;
 }
+
+// Make an activation layer that works on its input buffer directly
+// instead of copying it, see forward_activation_layer_inplace
+layer make_inplace_activation_layer(ACTIVATION a)
+{
+    layer l = make_activation_layer(a);
+    l.inplace = 1;
+    l.mask = calloc(1, sizeof(bitmask));
+    l.forward = forward_activation_layer_inplace;
+    l.backward = backward_activation_layer_inplace;
+    return l;
+}
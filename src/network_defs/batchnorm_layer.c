@@ -3,145 +3,131 @@
 #include <assert.h>
 #include "uwnet.h"
 
-// Take mean of matrix x over rows and spatial dimension
-// matrix x: matrix with data
-// int groups: number of distinct means to take, usually equal to # outputs
-// after connected layers or # channels after convolutional layers
-// returns: (1 x groups) matrix with means
-matrix mean(matrix x, int groups)
+// Apply a per-channel affine transform, groups are contiguous blocks of
+// x.cols/groups columns
+// matrix x: input, may be the same buffer as y
+// matrix y: output, y = x*scale + shift
+void scale_shift_batchnorm(matrix x, matrix y, float *scale, float *shift, int groups)
 {
-    assert(x.cols % groups == 0);
-    matrix m = make_matrix(1, groups);
-    int n = x.cols / groups;
-    int i, j;
-    for(i = 0; i < x.rows; ++i){
-        for(j = 0; j < x.cols; ++j){
-            m.data[j/n] += x.data[i*x.cols + j];
-        }
-    }
-    for(i = 0; i < m.cols; ++i){
-        m.data[i] = m.data[i] / x.rows / n;
-    }
-    return m;
-}
-
-// Take variance over matrix x given mean m
-matrix variance(matrix x, matrix m, int groups)
-{
-    matrix v = make_matrix(1, groups);
-    // TODO: 7.1 - Calculate variance
-    int i, j;
-    int n = x.cols / groups;
-    for(i = 0; i < x.rows; ++i){
-        for(j = 0; j < x.cols; ++j){
-            v.data[j/n] += pow(x.data[i*x.cols + j]-m.data[j/n],2);
-        }
-    }
-    for(i = 0; i < m.cols; ++i){
-        v.data[i] = v.data[i] / x.rows / n;
-    }
-    return v;
-}
-
-// Normalize x given mean m and variance v
-// returns: y = (x-m)/sqrt(v + epsilon)
-matrix normalize(matrix x, matrix m, matrix v, int groups)
-{
-    matrix norm = make_matrix(x.rows, x.cols);
-    float eps = 0.00001f;
-    // TODO: 7.2 - Normalize x
-    int i, j;
     int n = x.cols / groups;
+    int i, c, k;
     for(i = 0; i < x.rows; ++i){
-        for(j = 0; j < x.cols; ++j){
-            norm.data[i*x.cols+j] = (x.data[i*x.cols+j]-m.data[j/n])/sqrt(v.data[j/n]+eps);
+        for(c = 0; c < groups; ++c){
+            float *xp = x.data + i*x.cols + c*n;
+            float *yp = y.data + i*x.cols + c*n;
+            float sc = scale[c];
+            float sh = shift[c];
+            for(k = 0; k < n; ++k){
+                yp[k] = xp[k]*sc + sh;
+            }
         }
     }
-    return norm;
 }
 
-
 // Run an batchnorm layer on input
 // layer l: pointer to layer to run
 // matrix x: input to layer
-// returns: the result of running the layer y = (x - mu) / sigma
+// returns: the result of running the layer y = gamma * (x - mu) / sigma + beta
 matrix forward_batchnorm_layer(layer l, matrix x)
 {
-    // Saving our input
-    // Probably don't change this
-    free_matrix(*l.x);
-    *l.x = copy_matrix(x);
+    assert(x.cols % l.channels == 0);
+    float eps = 0.00001f;
+    float s = 0.1f;
+    int groups = l.channels;
+    int n = x.cols / groups;
+    int i, c, k;
+    matrix y = l.out ? view_matrix(l.out, x.rows, x.cols) : make_matrix(x.rows, x.cols);
 
-    if(x.rows == 1){
-        return normalize(x, l.rolling_mean, l.rolling_variance, l.channels);
+    if(l.inference){
+        // Leave the batch statistics alone, a training forward may still be
+        // waiting for its backward
+        for(c = 0; c < groups; ++c){
+            float sc = l.w.data[c]/sqrtf(l.rolling_variance.data[c] + eps);
+            float sh = l.b.data[c] - l.rolling_mean.data[c]*sc;
+            for(i = 0; i < x.rows; ++i){
+                float *xp = x.data + i*x.cols + c*n;
+                float *yp = y.data + i*x.cols + c*n;
+                for(k = 0; k < n; ++k) yp[k] = xp[k]*sc + sh;
+            }
+        }
+        return y;
     }
 
-    float s = 0.1;
-    matrix m = mean(x, l.channels);
-    matrix v = variance(x, m, l.channels);
-    matrix y = normalize(x, m, v, l.channels);
-
-    scal_matrix(1-s, l.rolling_mean);
-    axpy_matrix(s, m, l.rolling_mean);
-    scal_matrix(1-s, l.rolling_variance);
-    axpy_matrix(s, v, l.rolling_variance);
-
-    free_matrix(m);
-    free_matrix(v);
-
-    return y;
-}
-
-matrix delta_mean(matrix d, matrix v)
-{
-    int groups = v.cols;
-    matrix dm = make_matrix(1, groups);
-    // TODO 7.3 - Calculate dL/dm
-    float eps = 0.00001f;
-    int i,j;
-    int n=d.cols/groups;
-    for(i = 0; i < d.rows; ++i){
-        for(j = 0; j < d.cols; ++j){
-            dm.data[j/n]+=d.data[i*d.cols+j]*(-1/(sqrt(v.data[j/n]+eps)));
+    // One pass per channel over its contiguous spatial blocks. Sums are
+    // taken around the channel's first value so the sum of squares doesn't
+    // cancel badly when the mean is large, and there is no per-element divide.
+    // A single value per channel, e.g. one row after a connected layer, has
+    // no spread to normalize by, so it uses the rolling statistics as they
+    // are instead.
+    int rolling = x.rows*n <= 1;
+    for(c = 0; c < groups; ++c){
+        if(rolling){
+            l.batch_mean.data[c] = l.rolling_mean.data[c];
+            l.batch_istd.data[c] = 1.f/sqrtf(l.rolling_variance.data[c] + eps);
+            continue;
+        }
+        float shift = x.data[c*n];
+        float sum = 0;
+        float sum2 = 0;
+        for(i = 0; i < x.rows; ++i){
+            float *xp = x.data + i*x.cols + c*n;
+            for(k = 0; k < n; ++k){
+                float d = xp[k] - shift;
+                sum += d;
+                sum2 += d*d;
+            }
+        }
+        float count = x.rows*n;
+        float dmean = sum / count;
+        float mean = shift + dmean;
+        float var = sum2 / count - dmean*dmean;
+        if(var < 0) var = 0;
+        float istd = 1.f/sqrtf(var + eps);
+        l.batch_istd.data[c] = istd;
+        l.batch_mean.data[c] = mean;
+        // A recomputation for backward already counted this batch
+        if(!l.recompute){
+            l.rolling_mean.data[c] = (1-s)*l.rolling_mean.data[c] + s*mean;
+            l.rolling_variance.data[c] = (1-s)*l.rolling_variance.data[c] + s*var;
         }
     }
-    return dm;
-}
 
-
-matrix delta_variance(matrix d, matrix x, matrix m, matrix v)
-{
-    int groups = m.cols;
-    matrix dv = make_matrix(1, groups);
-    // TODO 7.4 - Calculate dL/dv
-    float eps = 0.00001f;
-    int i,j;
-    int n=d.cols/groups;
-    for(i = 0; i < d.rows; ++i){
-        for(j = 0; j < d.cols; ++j){
-            dv.data[j/n]+=d.data[i*d.cols+j]*(x.data[i*d.cols+j]-m.data[j/n])*(-0.5)*pow(v.data[j/n]+eps,-1.5);
+    if(l.nosave){
+        // The statistics will be recomputed too, so reuse their buffers
+        // for the combined scale and shift
+        for(c = 0; c < groups; ++c){
+            float sc = l.w.data[c]*l.batch_istd.data[c];
+            l.batch_mean.data[c] = l.b.data[c] - l.batch_mean.data[c]*sc;
+            l.batch_istd.data[c] = sc;
         }
+        scale_shift_batchnorm(x, y, l.batch_istd.data, l.batch_mean.data, groups);
+        return y;
     }
-    return dv;
-}
 
-matrix delta_batch_norm(matrix d, matrix dm, matrix dv, matrix m, matrix v, matrix x)
-{
-    matrix dx = make_matrix(d.rows, d.cols);
-    // TODO 7.5 - Calculate dL/dx
-    int groups = m.cols;
-    float eps = 0.00001f;
-    int i,j;
-    int n=d.cols/groups;
-    for(i = 0; i < d.rows; ++i){
-        for(j = 0; j < d.cols; ++j){
-            dx.data[i*d.cols+j]=d.data[i*d.cols+j]/sqrt(v.data[j/n]+eps)+
-            dv.data[j/n]*2*(x.data[i*d.cols+j]-m.data[j/n])/x.rows/n+dm.data[j/n]/x.rows/n;
+    // Backward only needs x_norm and the statistics, not x itself
+    if(l.x_norm->rows != x.rows || l.x_norm->cols != x.cols){
+        free_matrix(*l.x_norm);
+        *l.x_norm = make_matrix(x.rows, x.cols);
+    }
+    matrix xn = *l.x_norm;
+    for(i = 0; i < x.rows; ++i){
+        for(c = 0; c < groups; ++c){
+            float *xp = x.data + i*x.cols + c*n;
+            float *xnp = xn.data + i*x.cols + c*n;
+            float *yp = y.data + i*x.cols + c*n;
+            float mc = l.batch_mean.data[c];
+            float sc = l.batch_istd.data[c];
+            float g = l.w.data[c];
+            float b = l.b.data[c];
+            for(k = 0; k < n; ++k){
+                xnp[k] = (xp[k] - mc)*sc;
+                yp[k] = g*xnp[k] + b;
+            }
         }
     }
-    return dx;
-}
 
+    return y;
+}
 
 // Run an batchnorm layer on input
 // layer l: pointer to layer to run
@@ -149,41 +135,83 @@ matrix delta_batch_norm(matrix d, matrix dm, matrix dv, matrix m, matrix v, matr
 // returns: derivative of loss wrt input, dL/dx
 matrix backward_batchnorm_layer(layer l, matrix dy)
 {
-    matrix x = *l.x;
-
-    matrix m = mean(x, l.channels);
-    matrix v = variance(x, m, l.channels);
+    matrix xn = *l.x_norm;
+    assert(xn.rows == dy.rows && xn.cols == dy.cols);
+    int groups = l.channels;
+    int n = dy.cols / groups;
+    int i, c, k;
+    matrix dx = {0};
+    if(l.freeze && l.skip_dx) return dx;
+    if(!l.skip_dx) dx = make_matrix(dy.rows, dy.cols);
 
-    matrix dm = delta_mean(dy, v);
-    matrix dv = delta_variance(dy, x, m, v);
-    matrix dx = delta_batch_norm(dy, dm, dv, m, v, x);
+    // With xn = (x-m)*istd, dm and dv collapse into
+    // dx = gamma * istd * (dy - mean(dy) - xn * mean(dy * xn)) per channel
+    // and the same two sums are dL/dbeta and dL/dgamma
+    for(c = 0; c < groups; ++c){
+        float sum_dy = 0;
+        float sum_dy_xn = 0;
+        for(i = 0; i < dy.rows; ++i){
+            float *dyp = dy.data + i*dy.cols + c*n;
+            float *xnp = xn.data + i*dy.cols + c*n;
+            for(k = 0; k < n; ++k){
+                sum_dy += dyp[k];
+                sum_dy_xn += dyp[k]*xnp[k];
+            }
+        }
+        if(!l.freeze){
+            l.db.data[c] += sum_dy;
+            l.dw.data[c] += sum_dy_xn;
+        }
+        if(l.skip_dx) continue;
 
-    free_matrix(m);
-    free_matrix(v);
-    free_matrix(dm);
-    free_matrix(dv);
+        // The rolling statistics forward used for a single value are
+        // constants, so the mean terms drop out
+        float count = dy.rows*n;
+        float mdy = count > 1 ? sum_dy / count : 0;
+        float mdyxn = count > 1 ? sum_dy_xn / count : 0;
+        float istd = l.w.data[c]*l.batch_istd.data[c];
+        for(i = 0; i < dy.rows; ++i){
+            float *dyp = dy.data + i*dy.cols + c*n;
+            float *xnp = xn.data + i*dy.cols + c*n;
+            float *dxp = dx.data + i*dy.cols + c*n;
+            for(k = 0; k < n; ++k){
+                dxp[k] = istd*(dyp[k] - mdy - xnp[k]*mdyxn);
+            }
+        }
+    }
 
     return dx;
 }
 
-// Update batchnorm layer..... nothing happens tho
+// Update scale and shift of batchnorm layer
 // layer l: layer to update
-// float rate: SGD learning rate
-// float momentum: SGD momentum term
-// float decay: l2 normalization term
-void update_batchnorm_layer(layer l, float rate, float momentum, float decay){
-    (void) l;
-    (void) rate;
-    (void) momentum;
-    (void) decay;
+// optimizer *o: update rule, weight decay is not applied to scale and shift
+void update_batchnorm_layer(layer l, optimizer *o)
+{
+    if (l.freeze) return;
+    update_matrix(o, l.w, l.dw, l.wstate, 0);
+    update_matrix(o, l.b, l.db, l.bstate, 0);
 }
 
 layer make_batchnorm_layer(int groups)
 {
     layer l = {0};
+    l.type = BATCHNORM_LAYER;
     l.channels = groups;
-    l.x = calloc(1, sizeof(matrix));
+    l.x_norm = calloc(1, sizeof(matrix));
+
+    // Trainable per-channel scale (gamma) and shift (beta)
+    l.w = make_matrix(1, groups);
+    l.dw = make_matrix(1, groups);
+    l.b = make_matrix(1, groups);
+    l.db = make_matrix(1, groups);
+    int i;
+    for(i = 0; i < groups; ++i){
+        l.w.data[i] = 1;
+    }
 
+    l.batch_mean = make_matrix(1, groups);
+    l.batch_istd = make_matrix(1, groups);
     l.rolling_mean = make_matrix(1, groups);
     l.rolling_variance = make_matrix(1, groups);
 
@@ -192,3 +220,114 @@ layer make_batchnorm_layer(int groups)
     l.update = update_batchnorm_layer;
     return l;
 }
+
+// Scale or unscale the outputs of a conv/connected layer by a batchnorm
+// layer's inference statistics
+// layer l: layer whose w and b produce the normalized channels
+// layer bn: batchnorm layer right after l
+// int fold: 1 to fold bn into l, 0 to take it back out
+void fold_batchnorm_layer(layer l, layer bn, int fold)
+{
+    float eps = 0.00001f;
+    int i, j;
+    int outputs = l.b.cols;
+    assert(outputs % bn.channels == 0);
+    int n = outputs / bn.channels;
+    invalidate_weight_caches(l);
+
+    // y = gamma * (xw + b - mean) / sqrt(var + eps) + beta, so each output
+    // column of w and each bias gets scaled by the same per-channel factor
+    for(j = 0; j < outputs; ++j){
+        float s = bn.w.data[j/n]/sqrtf(bn.rolling_variance.data[j/n] + eps);
+        float m = bn.rolling_mean.data[j/n];
+        float beta = bn.b.data[j/n];
+        if(!fold) s = 1.f/s;
+        if(l.type == CONVOLUTIONAL_LAYER || l.type == DEPTHWISE_LAYER || l.type == CONV1D_LAYER){
+            for(i = 0; i < l.w.cols; ++i){
+                l.w.data[j*l.w.cols + i] *= s;
+            }
+        } else {
+            for(i = 0; i < l.w.rows; ++i){
+                l.w.data[i*l.w.cols + j] *= s;
+            }
+        }
+        if(fold) l.b.data[j] = (l.b.data[j] - m)*s + beta;
+        else     l.b.data[j] = (l.b.data[j] - beta)*s + m;
+    }
+}
+
+// Check that every channel of a batchnorm layer scales by a nonzero
+// finite factor, otherwise folding it could not be undone
+int batchnorm_invertible(layer bn)
+{
+    float eps = 0.00001f;
+    int c;
+    for(c = 0; c < bn.channels; ++c){
+        float s = bn.w.data[c]/sqrtf(bn.rolling_variance.data[c] + eps);
+        if(s == 0 || !isfinite(s) || !isfinite(1.f/s)) return 0;
+    }
+    return 1;
+}
+
+// Fold every batchnorm layer that directly follows a conv or connected
+// layer into that layer's weights and remove it from the net, so inference
+// costs no extra pass. The batchnorm layer is kept on l.folded so that
+// unfold_batchnorm_net can restore the net for continued training. A
+// batchnorm with a zero scale (gamma can train to 0) would wipe weights
+// that unfolding can't bring back, so it stays a separate layer.
+// net *m: network to transform in place
+void fold_batchnorm_net(net *m)
+{
+    int i;
+    int n = 0;
+    for(i = 0; i < m->n; ++i){
+        layer bn = m->layers[i];
+        if(n > 0 && bn.type == BATCHNORM_LAYER){
+            layer *l = &m->layers[n-1];
+            if((l->type == CONNECTED_LAYER || l->type == CONVOLUTIONAL_LAYER ||
+                l->type == DEPTHWISE_LAYER || l->type == CONV1D_LAYER) && !l->folded &&
+                batchnorm_invertible(bn)){
+                fold_batchnorm_layer(*l, bn, 1);
+                l->dirty = 1;
+                l->folded = calloc(1, sizeof(layer));
+                *l->folded = bn;
+                continue;
+            }
+        }
+        m->layers[n++] = bn;
+    }
+    m->n = n;
+}
+
+// Undo fold_batchnorm_net, putting the batchnorm layers back after the
+// layers they were folded into and restoring the original weights
+// net *m: network to transform in place
+void unfold_batchnorm_net(net *m)
+{
+    int i;
+    int folded = 0;
+    for(i = 0; i < m->n; ++i){
+        if(m->layers[i].folded) ++folded;
+    }
+    if(!folded) return;
+
+    layer *layers = calloc(m->n + folded, sizeof(layer));
+    int n = 0;
+    for(i = 0; i < m->n; ++i){
+        layer l = m->layers[i];
+        if(l.folded){
+            layer bn = *l.folded;
+            fold_batchnorm_layer(l, bn, 0);
+            free(l.folded);
+            l.folded = 0;
+            l.dirty = bn.dirty = 1;
+            layers[n++] = l;
+            layers[n++] = bn;
+        } else {
+            layers[n++] = l;
+        }
+    }
+    free(m->layers);
+    m->layers = layers;
+    m->n = n;
+}
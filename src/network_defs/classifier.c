@@ -21,6 +21,7 @@ int max_index(float *a, int n)
 
 float accuracy_net(net m, data d)
 {
+    m.inference = 1;
     matrix p = forward_net(m, d.x);
     int i;
     int correct = 0;
@@ -56,20 +57,43 @@ matrix cross_entropy_derivative(matrix x, matrix y)
 }
 
 void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay)
+{
+    optimizer o = make_sgd_optimizer(rate, momentum, decay);
+    train_image_classifier_opt(m, d, batch, iters, &o);
+}
+
+// Train with any optimizer, gradients are averaged over the batch
+void train_image_classifier_opt(net m, data d, int batch, int iters, optimizer *o)
+{
+    train_image_classifier_micro(m, d, batch, batch, iters, o);
+}
+
+// Train with a logical batch that is run through the net as micro-batches.
+// Gradients of all micro-batches accumulate in dw/db before a single
+// update, so activation memory scales with micro instead of batch.
+// Batchnorm statistics are still computed per micro-batch.
+// int batch: examples per update
+// int micro: examples per forward/backward pass
+void train_image_classifier_micro(net m, data d, int batch, int micro, int iters, optimizer *o)
 {
     srand(0);
+    o->scale = 1.f/batch;
     int e;
     for(e = 0; e < iters; ++e){
-        data b = random_batch(d, batch);
-        matrix yhat = forward_net(m, b.x);
-        float err = cross_entropy_loss(yhat, b.y);
-        matrix dy = cross_entropy_derivative(yhat, b.y);
-        // fprintf(stderr, "%06d: Loss: %f\n", e, err);
-        (void) err;
-        backward_net(m, dy);
-        update_net(m, rate/batch, momentum, decay);
-        free_data(b);
-        free_matrix(yhat);
-        free_matrix(dy);
+        int done;
+        for(done = 0; done < batch; done += micro){
+            int n = (batch - done < micro) ? batch - done : micro;
+            data b = random_batch(d, n);
+            matrix yhat = forward_net(m, b.x);
+            float err = cross_entropy_loss(yhat, b.y);
+            matrix dy = cross_entropy_derivative(yhat, b.y);
+            // fprintf(stderr, "%06d: Loss: %f\n", e, err);
+            (void) err;
+            backward_net(m, dy);
+            free_data(b);
+            free_matrix(yhat);
+            free_matrix(dy);
+        }
+        optimize_net(m, o);
     }
 }
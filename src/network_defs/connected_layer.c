@@ -3,23 +3,20 @@
 #include <assert.h>
 #include "uwnet.h"
 
-// Add bias terms to a matrix
-// matrix xw: partially computed output of layer
+// Add bias terms to a matrix in place
+// matrix xw: partially computed output of layer, becomes y = xw + b
 // matrix b: bias to add in (should only be one row!)
-// returns: y = wx + b
-matrix forward_bias(matrix xw, matrix b)
+void forward_bias(matrix xw, matrix b)
 {
     assert(b.rows == 1);
     assert(xw.cols == b.cols);
 
-    matrix y = copy_matrix(xw);
     int i,j;
     for(i = 0; i < xw.rows; ++i){
         for(j = 0; j < xw.cols; ++j){
-            y.data[i*y.cols + j] += b.data[j];
+            xw.data[i*xw.cols + j] += b.data[j];
         }
     }
-    return y;
 }
 
 // Calculate dL/db from a dL/dy
@@ -45,18 +42,17 @@ matrix forward_connected_layer(layer l, matrix x)
 {
 
 
-    // Saving our input
+    // Saving our input, unless backward will not need it from us
     // Probably don't change this
-    free_matrix(*l.x);
-    *l.x = copy_matrix(x);
-
-
+    if(!l.nosave){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(x);
+    }
 
-    matrix wx = matmul(x, l.w);
-    matrix y = forward_bias(wx, l.b);
+    matrix y = l.out ? view_matrix(l.out, x.rows, l.w.cols) : make_matrix(x.rows, l.w.cols);
+    matmul_into(x, l.w, y);
+    forward_bias(y, l.b);
 
-    free_matrix(wx);
-    
     return y;
 }
 
@@ -67,7 +63,10 @@ matrix forward_connected_layer(layer l, matrix x)
 matrix backward_connected_layer(layer l, matrix dy)
 {
     matrix x = *l.x;
+    matrix dx = {0};
 
+    // Frozen layers keep no gradient buffers
+    if(!l.freeze){
     // TODO: 3.2
     // Calculate the gradient dL/db for the bias terms using backward_bias
     // add this into any stored gradient info already in l.db
@@ -80,48 +79,40 @@ matrix backward_connected_layer(layer l, matrix dy)
     matrix dw = matmul(xt, dy);
     axpy_matrix(1, dw, l.dw);
 
-
-    // Calculate dL/dx and return it
-    // matrix dx = copy_matrix(x); // Change this
-    matrix wt = transpose_matrix(l.w);
-    matrix dx = matmul(dy, wt);
-
     free_matrix(dw);
     free_matrix(db);
     free_matrix(xt);
-    free_matrix(wt);
+    }
 
+    // Calculate dL/dx and return it
+    // matrix dx = copy_matrix(x); // Change this
+    if(!l.skip_dx){
+        matrix wt = transpose_matrix(l.w);
+        dx = matmul(dy, wt);
+        free_matrix(wt);
+    }
 
     return dx;
 }
 
 // Update weights and biases of connected layer
 // layer l: layer to update
-// float rate: SGD learning rate
-// float momentum: SGD momentum term
-// float decay: l2 normalization term
-void update_connected_layer(layer l, float rate, float momentum, float decay)
+// optimizer *o: update rule
+void update_connected_layer(layer l, optimizer *o)
 {
     if (l.freeze == 0){
 
-    // Apply our updates using our SGD update rule
-    // assume  l.dw = dL/dw - momentum * update_prev
-    // we want l.dw = dL/dw - momentum * update_prev + decay * w
-    // then we update l.w = l.w - rate * l.dw
-    // lastly, l.dw is the negative update (-update) but for the next iteration
-    // we want it to be (-momentum * update) so we just need to scale it a little
-    axpy_matrix(decay, l.w, l.dw);
-    axpy_matrix(-rate, l.dw, l.w);
-    scal_matrix(momentum, l.dw);
+    // Apply our updates in one fused pass per tensor, see update_matrix
+    update_matrix(o, l.w, l.dw, l.wstate, o->decay);
     // Do the same for biases as well but no need to use weight decay on biases
-    axpy_matrix(-rate, l.db, l.b);
-    scal_matrix(momentum, l.db);
+    update_matrix(o, l.b, l.db, l.bstate, 0);
     }
 }
 
 layer make_connected_layer(int inputs, int outputs)
 {
     layer l = {0};
+    l.type = CONNECTED_LAYER;
     l.w  = random_matrix(inputs, outputs, sqrtf(2.f/inputs));
     l.dw = make_matrix(inputs, outputs);
     l.b  = make_matrix(1, outputs);
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "uwnet.h"
+
+#if defined(__ZEPHYR__) && defined(CONFIG_CMSIS_DSP_TRANSFORM)
+#include <arm_math.h>
+#endif
+
+// Kernels this long go through the FFT, shorter ones are cheaper direct:
+// at 7 taps the transforms of a 32 point block cost more than the MACs
+#define FFT_MIN_TAPS 24
+
+// Real FFTs use the packed layout of arm_rfft_fast_f32: buf[0] is the DC
+// term, buf[1] the Nyquist term, then re, im pairs for bins 1..n/2-1.
+// The inverse is scaled by 1/n.
+#if defined(__ZEPHYR__) && defined(CONFIG_CMSIS_DSP_TRANSFORM)
+// n: power of two from 32 to 4096
+// float *buf: n floats, transformed in place
+// float *tmp: n floats of scratch
+void rfft(float *buf, float *tmp, int n, int inverse)
+{
+    static arm_rfft_fast_instance_f32 s;
+    static int size = 0;
+    if(size != n){
+        arm_rfft_fast_init_f32(&s, n);
+        size = n;
+    }
+    memcpy(tmp, buf, n*sizeof(float));
+    arm_rfft_fast_f32(&s, tmp, buf, inverse);
+}
+#else
+// Iterative radix-2 complex FFT on interleaved re, im. Twiddles are
+// kept for the last size used, which is the common case.
+void fft(float *z, int n, int inverse)
+{
+    static float *twiddle = 0;
+    static int size = 0;
+    const float pi = 3.14159265358979f;
+    int i, j, k, len;
+    if(size != n){
+        free(twiddle);
+        twiddle = calloc(n, sizeof(float));
+        for(k = 0; k < n/2; ++k){
+            twiddle[2*k] = cosf(2*pi*k/n);
+            twiddle[2*k+1] = -sinf(2*pi*k/n);
+        }
+        size = n;
+    }
+    for(i = 1, j = 0; i < n; ++i){
+        int bit = n >> 1;
+        for(; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if(i < j){
+            float t = z[2*i];   z[2*i] = z[2*j];     z[2*j] = t;
+            t = z[2*i+1];       z[2*i+1] = z[2*j+1]; z[2*j+1] = t;
+        }
+    }
+    for(len = 2; len <= n; len <<= 1){
+        int stride = n/len;
+        for(i = 0; i < n; i += len){
+            for(k = 0; k < len/2; ++k){
+                float wr = twiddle[2*k*stride];
+                float wi = inverse ? -twiddle[2*k*stride+1] : twiddle[2*k*stride+1];
+                float *u = z + 2*(i + k);
+                float *v = z + 2*(i + k + len/2);
+                float vr = v[0]*wr - v[1]*wi;
+                float vi = v[0]*wi + v[1]*wr;
+                v[0] = u[0] - vr;
+                v[1] = u[1] - vi;
+                u[0] += vr;
+                u[1] += vi;
+            }
+        }
+    }
+}
+
+// Portable stand in for arm_rfft_fast_f32, same packed layout
+// float *tmp: 2*n floats of scratch
+void rfft(float *buf, float *tmp, int n, int inverse)
+{
+    int i;
+    if(!inverse){
+        for(i = 0; i < n; ++i){
+            tmp[2*i] = buf[i];
+            tmp[2*i+1] = 0;
+        }
+        fft(tmp, n, 0);
+        buf[0] = tmp[0];
+        buf[1] = tmp[n];
+        memcpy(buf + 2, tmp + 2, (n-2)*sizeof(float));
+    } else {
+        // Rebuild the full Hermitian spectrum
+        tmp[0] = buf[0];
+        tmp[1] = 0;
+        tmp[n] = buf[1];
+        tmp[n+1] = 0;
+        for(i = 1; i < n/2; ++i){
+            tmp[2*i] = tmp[2*(n-i)] = buf[2*i];
+            tmp[2*i+1] = buf[2*i+1];
+            tmp[2*(n-i)+1] = -buf[2*i+1];
+        }
+        fft(tmp, n, 1);
+        for(i = 0; i < n; ++i){
+            buf[i] = tmp[2*i]/n;
+        }
+    }
+}
+#endif
+
+// z += x * h for packed spectra
+void spectrum_mul_add(const float *x, const float *h, float *z, int n)
+{
+    int i;
+    z[0] += x[0]*h[0];
+    z[1] += x[1]*h[1];
+    for(i = 2; i < n; i += 2){
+        z[i]   += x[i]*h[i]   - x[i+1]*h[i+1];
+        z[i+1] += x[i]*h[i+1] + x[i+1]*h[i];
+    }
+}
+
+// FFT size for overlap-add: about four kernels long, but no longer than
+// the whole signal needs
+int conv1d_fft_size(layer l)
+{
+    int want = 4*l.size;
+    if(l.width + l.size - 1 < want) want = l.width + l.size - 1;
+    int n = 32;
+    while(n < want && n < 4096) n <<= 1;
+    return n;
+}
+
+// Spectra of the reversed filters, so that multiplying spectra gives the
+// correlation a conv layer computes. One row per filter and channel.
+void make_conv1d_spectra(layer l, int n, float *tmp)
+{
+    int f, c, j;
+    *l.spectra = make_matrix(l.filters*l.channels, n);
+    for(f = 0; f < l.filters; ++f){
+        for(c = 0; c < l.channels; ++c){
+            float *h = l.spectra->data + (f*l.channels + c)*n;
+            float *w = l.w.data + (f*l.channels + c)*l.size;
+            for(j = 0; j < l.size; ++j){
+                h[j] = w[l.size - 1 - j];
+            }
+            rfft(h, tmp, n, 0);
+        }
+    }
+}
+
+// Overlap-add: each block of n - size + 1 inputs is transformed once per
+// channel, the products are summed over channels in the frequency domain
+// and transformed back once per filter
+// float *x: one example, channels x width
+// float *y: output, filters x (width - size + 1), biases already in
+// float *scratch: (channels + 3) * conv1d_fft_size(l) floats
+void forward_conv1d_fft(layer l, float *x, float *y, float *scratch)
+{
+    int n = conv1d_fft_size(l);
+    int step = n - l.size + 1;
+    int outw = l.width - l.size + 1;
+    float *tmp = scratch;
+    float *xs = tmp + 2*n;
+    float *z = xs + l.channels*n;
+    int p, c, f, j;
+
+    if(!l.spectra->data) make_conv1d_spectra(l, n, tmp);
+
+    for(p = 0; p < l.width; p += step){
+        int len = (l.width - p < step) ? l.width - p : step;
+        for(c = 0; c < l.channels; ++c){
+            float *s = xs + c*n;
+            memcpy(s, x + c*l.width + p, len*sizeof(float));
+            memset(s + len, 0, (n - len)*sizeof(float));
+            rfft(s, tmp, n, 0);
+        }
+        for(f = 0; f < l.filters; ++f){
+            memset(z, 0, n*sizeof(float));
+            for(c = 0; c < l.channels; ++c){
+                spectrum_mul_add(xs + c*n, l.spectra->data + (f*l.channels + c)*n, z, n);
+            }
+            rfft(z, tmp, n, 1);
+            // Full convolution index p + j is valid output p + j - (size-1)
+            float *o = y + f*outw;
+            for(j = 0; j < len + l.size - 1; ++j){
+                int t = p + j - (l.size - 1);
+                if(t >= 0 && t < outw) o[t] += z[j];
+            }
+        }
+    }
+}
+
+// Run a 1-D convolutional layer on input
+// layer l: layer to run
+// matrix in: input to layer, channels x width per row
+// returns: the result of running the layer, filters x (width-size+1)
+matrix forward_conv1d_layer(layer l, matrix in)
+{
+    assert(in.cols == l.width*l.channels);
+    if(!l.nosave){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(in);
+    }
+
+    int outw = l.width - l.size + 1;
+    int cols = outw*l.filters;
+    matrix y = l.out ? view_matrix(l.out, in.rows, cols) : make_matrix(in.rows, cols);
+
+    // Kernels longer than the largest FFT block run direct, and so does
+    // everything if there is no memory for the FFT scratch
+    float *scratch = 0;
+    if(l.spectra && conv1d_fft_size(l) - l.size + 1 > 0){
+        scratch = calloc((l.channels + 3)*conv1d_fft_size(l), sizeof(float));
+    }
+
+    int i, f, c, j, t;
+    for(i = 0; i < in.rows; ++i){
+        float *x = in.data + i*in.cols;
+        float *yi = y.data + i*cols;
+        for(f = 0; f < l.filters; ++f){
+            for(t = 0; t < outw; ++t) yi[f*outw + t] = l.b.data[f];
+        }
+        if(scratch){
+            forward_conv1d_fft(l, x, yi, scratch);
+            continue;
+        }
+        for(f = 0; f < l.filters; ++f){
+            float *o = yi + f*outw;
+            for(c = 0; c < l.channels; ++c){
+                float *w = l.w.data + (f*l.channels + c)*l.size;
+                float *xc = x + c*l.width;
+                for(j = 0; j < l.size; ++j){
+                    for(t = 0; t < outw; ++t){
+                        o[t] += w[j]*xc[t + j];
+                    }
+                }
+            }
+        }
+    }
+    free(scratch);
+    return y;
+}
+
+// Run a 1-D convolutional layer backward
+// layer l: layer to run
+// matrix dy: derivative of loss wrt output dL/dy
+// returns: derivative of loss wrt input dL/dx
+matrix backward_conv1d_layer(layer l, matrix dy)
+{
+    matrix in = *l.x;
+    matrix dx = {0};
+    if(l.freeze && l.skip_dx) return dx;
+    if(!l.skip_dx) dx = make_matrix(dy.rows, in.cols);
+
+    int outw = l.width - l.size + 1;
+    int i, f, c, j, t;
+    for(i = 0; i < dy.rows; ++i){
+        for(f = 0; f < l.filters; ++f){
+            float *d = dy.data + i*dy.cols + f*outw;
+            if(!l.freeze){
+                for(t = 0; t < outw; ++t) l.db.data[f] += d[t];
+            }
+            for(c = 0; c < l.channels; ++c){
+                float *x = in.data + i*in.cols + c*l.width;
+                float *w = l.w.data + (f*l.channels + c)*l.size;
+                float *dw = l.dw.data + (f*l.channels + c)*l.size;
+                for(j = 0; j < l.size; ++j){
+                    if(!l.freeze){
+                        float sum = 0;
+                        for(t = 0; t < outw; ++t) sum += d[t]*x[t + j];
+                        dw[j] += sum;
+                    }
+                    if(!l.skip_dx){
+                        float *dxc = dx.data + i*dx.cols + c*l.width + j;
+                        for(t = 0; t < outw; ++t) dxc[t] += w[j]*d[t];
+                    }
+                }
+            }
+        }
+    }
+    return dx;
+}
+
+// Update 1-D convolutional layer
+// layer l: layer to update
+// optimizer *o: update rule
+void update_conv1d_layer(layer l, optimizer *o)
+{
+    if(l.freeze) return;
+    invalidate_weight_caches(l);
+    update_matrix(o, l.w, l.dw, l.wstate, o->decay);
+    update_matrix(o, l.b, l.db, l.bstate, 0);
+}
+
+// Make a 1-D convolutional layer for sensor signals, stride 1 and no
+// padding. Kernels of FFT_MIN_TAPS or more run forward with FFT
+// overlap-add, arm_rfft_fast_f32 on target.
+// int length: samples per channel
+// int c: number of channels
+// int filters: number of filters
+// int size: taps per filter
+layer make_conv1d_layer(int length, int c, int filters, int size)
+{
+    layer l = {0};
+    l.type = CONV1D_LAYER;
+    l.width = length;
+    l.height = 1;
+    l.channels = c;
+    l.filters = filters;
+    l.size = size;
+    l.stride = 1;
+
+    l.w  = random_matrix(filters, size*c, sqrtf(2.f/(size*c)));
+    l.dw = make_matrix(filters, size*c);
+    l.b  = make_matrix(1, filters);
+    l.db = make_matrix(1, filters);
+    l.x = calloc(1, sizeof(matrix));
+    l.forward  = forward_conv1d_layer;
+    l.backward = backward_conv1d_layer;
+    l.update   = update_conv1d_layer;
+    if(size >= FFT_MIN_TAPS) l.spectra = calloc(1, sizeof(matrix));
+    return l;
+}
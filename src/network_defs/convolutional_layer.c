@@ -5,23 +5,24 @@
 #include "uwnet.h"
 // #include "boards.h"
 
-// Add bias terms to a matrix
+// Add bias terms to a matrix in place
 // matrix m: partially computed output of layer
 // matrix b: bias to add in (should only be one row!)
-matrix forward_convolutional_bias(matrix xw, matrix b)
+void forward_convolutional_bias(matrix xw, matrix b)
 {
     assert(b.rows == 1);
     assert(xw.cols % b.cols == 0);
 
-    matrix y = copy_matrix(xw);
     int spatial = xw.cols / b.cols;
-    int i,j;
-    for(i = 0; i < y.rows; ++i){
-        for(j = 0; j < y.cols; ++j){
-            y.data[i*y.cols + j] += b.data[j/spatial];
+    int i,j,k;
+    for(i = 0; i < xw.rows; ++i){
+        for(j = 0; j < b.cols; ++j){
+            float *y = xw.data + i*xw.cols + j*spatial;
+            for(k = 0; k < spatial; ++k){
+                y[k] += b.data[j];
+            }
         }
     }
-    return y;
 }
 
 // Calculate bias updates from a delta matrix
@@ -225,6 +226,163 @@ image col2im(int width, int height, int channels, matrix col, int size, int stri
 //     return im;
 // }
 
+// Winograd F(2x2,3x3): every 2x2 output tile is A^T [(G g G^T) . (B^T d B)] A
+// for a 4x4 input tile d, 16 multiplies per channel instead of 36. Grouping
+// the 16 tile positions turns the products into 16 matmuls of
+// filters x channels by channels x tiles, run over chunks of tiles so the
+// scratch stays within WINOGRAD_SCRATCH_BYTES.
+
+// Memory Winograd may use: transformed filters take 16/9 of the weights
+// and stay cached, the tile scratch is per forward call. Layers that would
+// need more keep using im2col.
+#ifndef WINOGRAD_FILTER_BYTES
+#define WINOGRAD_FILTER_BYTES (64*1024)
+#endif
+#ifndef WINOGRAD_SCRATCH_BYTES
+#define WINOGRAD_SCRATCH_BYTES (16*1024)
+#endif
+// Fewest tiles per chunk worth the transform overhead
+#define WINOGRAD_MIN_TILES 4
+
+// Tiles per chunk that fit the scratch budget
+int winograd_chunk(layer l)
+{
+    return WINOGRAD_SCRATCH_BYTES / (16*(l.channels + l.filters)*(int)sizeof(float));
+}
+
+// Turn the Winograd path of a conv layer on or off
+// layer *l: conv layer
+// int on: 1 to use Winograd if the layer is 3x3 stride 1 and its filters
+//         and scratch fit the budgets above, 0 to always use im2col
+// returns: 1 if the layer now uses Winograd
+int set_winograd(layer *l, int on)
+{
+    if(l->winograd){
+        free_matrix(*l->winograd);
+        free(l->winograd);
+        l->winograd = 0;
+    }
+    if(!on || l->type != CONVOLUTIONAL_LAYER || l->size != 3 || l->stride != 1) return 0;
+    if(16*l->filters*l->channels*sizeof(float) > WINOGRAD_FILTER_BYTES) return 0;
+    if(winograd_chunk(*l) < WINOGRAD_MIN_TILES) return 0;
+    // Filters pre-transformed for Winograd, built on first use
+    l->winograd = calloc(1, sizeof(matrix));
+    return 1;
+}
+
+// Make the transformed filters G g G^T, stored as 16 matrices of
+// filters x channels one after the other
+void winograd_transform_filters(layer l, matrix u)
+{
+    int f, c, i, j;
+    int fc = l.filters*l.channels;
+    for(f = 0; f < l.filters; ++f){
+        for(c = 0; c < l.channels; ++c){
+            float *g = l.w.data + (f*l.channels + c)*9;
+            float t[4][3];
+            // t = G g
+            for(j = 0; j < 3; ++j){
+                t[0][j] = g[j];
+                t[1][j] = .5f*(g[j] + g[3+j] + g[6+j]);
+                t[2][j] = .5f*(g[j] - g[3+j] + g[6+j]);
+                t[3][j] = g[6+j];
+            }
+            // u = t G^T
+            for(i = 0; i < 4; ++i){
+                float v[4];
+                v[0] = t[i][0];
+                v[1] = .5f*(t[i][0] + t[i][1] + t[i][2]);
+                v[2] = .5f*(t[i][0] - t[i][1] + t[i][2]);
+                v[3] = t[i][2];
+                for(j = 0; j < 4; ++j){
+                    u.data[(i*4 + j)*fc + f*l.channels + c] = v[j];
+                }
+            }
+        }
+    }
+}
+
+// Run a 3x3 stride 1 convolution on one example with Winograd F(2x2,3x3)
+// layer l: layer to run, l.winograd holds the transformed filters
+// float *x: input image
+// float *y: output, filters x outh x outw
+// float *v, *m: scratch for 16*channels and 16*filters rows of
+//               winograd_chunk(l) tiles
+void forward_convolutional_winograd(layer l, float *x, float *y, float *v, float *m)
+{
+    int outw = l.width - 2;
+    int outh = l.height - 2;
+    int tw = (outw + 1)/2;
+    int th = (outh + 1)/2;
+    int tiles = tw*th;
+    int chunk = winograd_chunk(l);
+    int fc = l.filters*l.channels;
+    int c, f, t, i, j, t0;
+
+    for(t0 = 0; t0 < tiles; t0 += chunk){
+        int n = (tiles - t0 < chunk) ? tiles - t0 : chunk;
+
+        // v = B^T d B for every channel and tile, zero past the image edge
+        for(c = 0; c < l.channels; ++c){
+            float *im = x + c*l.width*l.height;
+            for(t = 0; t < n; ++t){
+                int y0 = ((t0 + t) / tw)*2;
+                int x0 = ((t0 + t) % tw)*2;
+                float d[4][4];
+                float s[4][4];
+                for(i = 0; i < 4; ++i){
+                    for(j = 0; j < 4; ++j){
+                        int yy = y0 + i;
+                        int xx = x0 + j;
+                        d[i][j] = (yy < l.height && xx < l.width) ? im[yy*l.width + xx] : 0;
+                    }
+                }
+                for(j = 0; j < 4; ++j){
+                    s[0][j] = d[0][j] - d[2][j];
+                    s[1][j] = d[1][j] + d[2][j];
+                    s[2][j] = d[2][j] - d[1][j];
+                    s[3][j] = d[1][j] - d[3][j];
+                }
+                for(i = 0; i < 4; ++i){
+                    float *r = v + (i*4*l.channels + c)*n + t;
+                    r[0]              = s[i][0] - s[i][2];
+                    r[l.channels*n]   = s[i][1] + s[i][2];
+                    r[2*l.channels*n] = s[i][2] - s[i][1];
+                    r[3*l.channels*n] = s[i][1] - s[i][3];
+                }
+            }
+        }
+
+        for(i = 0; i < 16; ++i){
+            matmul_into(view_matrix(l.winograd->data + i*fc, l.filters, l.channels),
+                    view_matrix(v + i*l.channels*n, l.channels, n),
+                    view_matrix(m + i*l.filters*n, l.filters, n));
+        }
+
+        // y = A^T m A, keeping only outputs inside the image
+        for(f = 0; f < l.filters; ++f){
+            float *o = y + f*outw*outh;
+            for(t = 0; t < n; ++t){
+                int y0 = ((t0 + t) / tw)*2;
+                int x0 = ((t0 + t) % tw)*2;
+                float p[4][4];
+                float s[2][4];
+                for(i = 0; i < 16; ++i){
+                    p[i/4][i%4] = m[(i*l.filters + f)*n + t];
+                }
+                for(j = 0; j < 4; ++j){
+                    s[0][j] = p[0][j] + p[1][j] + p[2][j];
+                    s[1][j] = p[1][j] - p[2][j] - p[3][j];
+                }
+                for(i = 0; i < 2 && y0 + i < outh; ++i){
+                    o[(y0 + i)*outw + x0] = s[i][0] + s[i][1] + s[i][2];
+                    if(x0 + 1 < outw) o[(y0 + i)*outw + x0 + 1] = s[i][1] - s[i][2] - s[i][3];
+                }
+            }
+        }
+    }
+}
+
 // Run a convolutional layer on input
 // layer l: pointer to layer to run
 // matrix in: input to layer
@@ -234,38 +392,52 @@ matrix forward_convolutional_layer(layer l, matrix in)
 
 
     assert(in.cols == l.width*l.height*l.channels);
-    // Saving our input
+    // Saving our input, unless backward will not need it from us
     // Probably don't change this
-    free_matrix(*l.x);
-    *l.x = copy_matrix(in);
+    if(!l.nosave){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(in);
+    }
 
-    int i, j;
+    int i;
     // int outw = (l.width-1)/l.stride + 1;
     // int outh = (l.height-1)/l.stride + 1;
 
     int outw = ((l.width  - l.size)/l.stride )  + 1;
     int outh = ((l.height - l.size)/l.stride ) + 1;
 
-    matrix out = make_matrix(in.rows, outw*outh*l.filters);
+    int cols = outw*outh*l.filters;
+    matrix y = l.out ? view_matrix(l.out, in.rows, cols) : make_matrix(in.rows, cols);
     // printf("rows %d , cols\n %d", in.rows,outw*outh*l.filters );
 
 
   
 
-    for(i = 0; i < in.rows; ++i){
-        image example = float_to_image(in.data + i*in.cols, l.width, l.height, l.channels);
-        matrix x = im2col(example, l.size, l.stride);
-
-        matrix wx = matmul(l.w, x);
-        for(j = 0; j < wx.rows*wx.cols; ++j){
-            out.data[i*out.cols + j] = wx.data[j];
+    // Qualifying 3x3 stride 1 layers take the Winograd path, see set_winograd
+    if(l.winograd){
+        if(!l.winograd->data){
+            *l.winograd = make_matrix(16, l.filters*l.channels);
+            winograd_transform_filters(l, *l.winograd);
+        }
+        int chunk = winograd_chunk(l);
+        float *v = calloc(16*l.channels*chunk, sizeof(float));
+        float *m = calloc(16*l.filters*chunk, sizeof(float));
+        for(i = 0; i < in.rows; ++i){
+            forward_convolutional_winograd(l, in.data + i*in.cols, y.data + i*cols, v, m);
+        }
+        free(v);
+        free(m);
+    } else {
+        for(i = 0; i < in.rows; ++i){
+            image example = float_to_image(in.data + i*in.cols, l.width, l.height, l.channels);
+            matrix x = im2col(example, l.size, l.stride);
+
+            matmul_into(l.w, x, view_matrix(y.data + i*cols, l.filters, outw*outh));
+            free_matrix(x);
         }
-        free_matrix(x);
-        free_matrix(wx);
     }
 
-    matrix y = forward_convolutional_bias(out, l.b);
-    free_matrix(out);
+    forward_convolutional_bias(y, l.b);
     
     // stop = DWT->CYCCNT;
     // elapsed = stop-start;
@@ -294,13 +466,21 @@ matrix backward_convolutional_layer(layer l, matrix dy)
     int outh = ((l.height - l.size) / l.stride ) + 1;
 
     
-    matrix db = backward_convolutional_bias(dy, l.db.cols);
-    axpy_matrix(1, db, l.db);
-    free_matrix(db);
+    matrix dx = {0};
+    if(l.freeze && l.skip_dx) return dx;
+
+    if(!l.freeze){
+        matrix db = backward_convolutional_bias(dy, l.filters);
+        axpy_matrix(1, db, l.db);
+        free_matrix(db);
+    }
 
 
-    matrix dx = make_matrix(dy.rows, l.width*l.height*l.channels);
-    matrix wt = transpose_matrix(l.w);
+    matrix wt = {0};
+    if(!l.skip_dx){
+        dx = make_matrix(dy.rows, l.width*l.height*l.channels);
+        wt = transpose_matrix(l.w);
+    }
 
     for(i = 0; i < in.rows ; ++i){
         image example = float_to_image(in.data + i*in.cols, l.width, l.height, l.channels);
@@ -308,22 +488,26 @@ matrix backward_convolutional_layer(layer l, matrix dy)
         dy.rows = l.filters;
         dy.cols = outw*outh;
 
-        matrix x = im2col(example, l.size, l.stride);
-        matrix xt = transpose_matrix(x);
-        // printf(" dy cols %d  , x rows %d \n", dy.cols, xt.rows); 
-        matrix dw = matmul(dy, xt);
-        // printf(" 2 dy cols %d  , x rows %d \n", dy.cols, xt.rows);
-        axpy_matrix(1, dw, l.dw);
-
-        matrix col = matmul(wt, dy);
-        image dxi = col2im(l.width, l.height, l.channels, col, l.size, l.stride);
-        memcpy(dx.data + i*dx.cols, dxi.data, dx.cols * sizeof(float));
-        free_matrix(col);
+        if(!l.freeze){
+            matrix x = im2col(example, l.size, l.stride);
+            matrix xt = transpose_matrix(x);
+            // printf(" dy cols %d  , x rows %d \n", dy.cols, xt.rows); 
+            matrix dw = matmul(dy, xt);
+            // printf(" 2 dy cols %d  , x rows %d \n", dy.cols, xt.rows);
+            axpy_matrix(1, dw, l.dw);
+
+            free_matrix(x);
+            free_matrix(xt);
+            free_matrix(dw);
+        }
 
-        free_matrix(x);
-        free_matrix(xt);
-        free_matrix(dw);
-        free_image(dxi);
+        if(!l.skip_dx){
+            matrix col = matmul(wt, dy);
+            image dxi = col2im(l.width, l.height, l.channels, col, l.size, l.stride);
+            memcpy(dx.data + i*dx.cols, dxi.data, dx.cols * sizeof(float));
+            free_matrix(col);
+            free_image(dxi);
+        }
 
         dy.data = dy.data + dy.rows*dy.cols;
     }
@@ -341,18 +525,13 @@ matrix backward_convolutional_layer(layer l, matrix dy)
 
 // Update convolutional layer
 // layer l: layer to update
-// float rate: learning rate
-// float momentum: momentum term
-// float decay: l2 regularization term
-void update_convolutional_layer(layer l, float rate, float momentum, float decay)
+// optimizer *o: update rule
+void update_convolutional_layer(layer l, optimizer *o)
 {
-   
-    axpy_matrix(decay,l.w,l.dw);
-    axpy_matrix(-rate,l.dw,l.w);
-    scal_matrix(momentum,l.dw);
-    axpy_matrix(-rate,l.db,l.b);
-    scal_matrix(momentum,l.db); 
-
+    if(l.freeze) return;
+    invalidate_weight_caches(l);
+    update_matrix(o, l.w, l.dw, l.wstate, o->decay);
+    update_matrix(o, l.b, l.db, l.bstate, 0);
 }
 
 // Make a new convolutional layer
@@ -364,6 +543,7 @@ void update_convolutional_layer(layer l, float rate, float momentum, float decay
 layer make_convolutional_layer(int w, int h, int c, int filters, int size, int stride)
 {
     layer l = {0};
+    l.type = CONVOLUTIONAL_LAYER;
     l.width = w;
     l.height = h;
     l.channels = c;
@@ -380,6 +560,7 @@ layer make_convolutional_layer(int w, int h, int c, int filters, int size, int s
     l.forward  = forward_convolutional_layer;
     l.backward = backward_convolutional_layer;
     l.update   = update_convolutional_layer;
+    set_winograd(&l, 1);
     return l;
 
 }
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include "uwnet.h"
+
+// Run a depthwise convolutional layer on input, every channel is
+// convolved with its own size x size filter
+// layer l: layer to run
+// matrix in: input to layer
+// returns: the result of running the layer, same channels as the input
+matrix forward_depthwise_layer(layer l, matrix in)
+{
+    assert(in.cols == l.width*l.height*l.channels);
+    if(!l.nosave){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(in);
+    }
+
+    int outw = (l.width - l.size)/l.stride + 1;
+    int outh = (l.height - l.size)/l.stride + 1;
+    int cols = outw*outh*l.channels;
+    matrix y = l.out ? view_matrix(l.out, in.rows, cols) : make_matrix(in.rows, cols);
+
+    int i, c, ky, kx, oy, ox;
+    for(i = 0; i < in.rows; ++i){
+        for(c = 0; c < l.channels; ++c){
+            float *im = in.data + i*in.cols + c*l.width*l.height;
+            float *o = y.data + i*cols + c*outw*outh;
+            float *w = l.w.data + c*l.size*l.size;
+            for(oy = 0; oy < outh*outw; ++oy) o[oy] = l.b.data[c];
+            for(ky = 0; ky < l.size; ++ky){
+                for(kx = 0; kx < l.size; ++kx){
+                    float v = w[ky*l.size + kx];
+                    for(oy = 0; oy < outh; ++oy){
+                        float *row = im + (oy*l.stride + ky)*l.width + kx;
+                        for(ox = 0; ox < outw; ++ox){
+                            o[oy*outw + ox] += v*row[ox*l.stride];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return y;
+}
+
+// Run a depthwise convolutional layer backward
+// layer l: layer to run
+// matrix dy: derivative of loss wrt output dL/dy
+// returns: derivative of loss wrt input dL/dx
+matrix backward_depthwise_layer(layer l, matrix dy)
+{
+    matrix in = *l.x;
+    matrix dx = {0};
+    if(l.freeze && l.skip_dx) return dx;
+
+    int outw = (l.width - l.size)/l.stride + 1;
+    int outh = (l.height - l.size)/l.stride + 1;
+    if(!l.skip_dx) dx = make_matrix(dy.rows, in.cols);
+
+    int i, c, ky, kx, oy, ox;
+    for(i = 0; i < dy.rows; ++i){
+        for(c = 0; c < l.channels; ++c){
+            float *im = in.data + i*in.cols + c*l.width*l.height;
+            float *d = dy.data + i*dy.cols + c*outw*outh;
+            float *w = l.w.data + c*l.size*l.size;
+            float *dw = l.dw.data + c*l.size*l.size;
+            if(!l.freeze){
+                for(oy = 0; oy < outh*outw; ++oy) l.db.data[c] += d[oy];
+            }
+            for(ky = 0; ky < l.size; ++ky){
+                for(kx = 0; kx < l.size; ++kx){
+                    float v = w[ky*l.size + kx];
+                    float sum = 0;
+                    for(oy = 0; oy < outh; ++oy){
+                        int offset = (oy*l.stride + ky)*l.width + kx;
+                        float *row = im + offset;
+                        for(ox = 0; ox < outw; ++ox){
+                            sum += d[oy*outw + ox]*row[ox*l.stride];
+                        }
+                        if(!l.skip_dx){
+                            float *drow = dx.data + i*dx.cols + c*l.width*l.height + offset;
+                            for(ox = 0; ox < outw; ++ox){
+                                drow[ox*l.stride] += v*d[oy*outw + ox];
+                            }
+                        }
+                    }
+                    if(!l.freeze) dw[ky*l.size + kx] += sum;
+                }
+            }
+        }
+    }
+    return dx;
+}
+
+// Update depthwise convolutional layer
+// layer l: layer to update
+// optimizer *o: update rule
+void update_depthwise_layer(layer l, optimizer *o)
+{
+    if(l.freeze) return;
+    update_matrix(o, l.w, l.dw, l.wstate, o->decay);
+    update_matrix(o, l.b, l.db, l.bstate, 0);
+}
+
+// Make a new depthwise convolutional layer. Follow it with a size 1
+// convolutional layer for a depthwise separable convolution.
+// int w: width of input image
+// int h: height of input image
+// int c: number of channels, also the number of filters
+// int size: size of convolutional filter to apply
+// int stride: stride of operation
+layer make_depthwise_layer(int w, int h, int c, int size, int stride)
+{
+    layer l = {0};
+    l.type = DEPTHWISE_LAYER;
+    l.width = w;
+    l.height = h;
+    l.channels = c;
+    l.filters = c;
+    l.size = size;
+    l.stride = stride;
+
+    l.w  = random_matrix(c, size*size, sqrtf(2.f/(size*size)));
+    l.dw = make_matrix(c, size*size);
+    l.b  = make_matrix(1, c);
+    l.db = make_matrix(1, c);
+    l.x = calloc(1, sizeof(matrix));
+    l.forward  = forward_depthwise_layer;
+    l.backward = backward_depthwise_layer;
+    l.update   = update_depthwise_layer;
+    return l;
+}
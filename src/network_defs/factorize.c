@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "uwnet.h"
+
+// Pick the rank that keeps a fraction of the squared singular values
+// matrix s: singular values, descending
+// float energy: fraction to keep, e.g. .95
+// returns: smallest rank reaching it
+int energy_rank(matrix s, float energy)
+{
+    int k = s.cols;
+    int r;
+    double total = 0;
+    double kept = 0;
+    for(r = 0; r < k; ++r) total += (double)s.data[r]*s.data[r];
+    for(r = 0; r < k; ++r){
+        kept += (double)s.data[r]*s.data[r];
+        if(kept >= energy*total) return r+1;
+    }
+    return k;
+}
+
+// Replace a connected layer with two thinner ones, x*w ~ (x*w1)*w2, from
+// a truncated SVD w = u*s*v^T. Both factors get sqrt(s) so they start out
+// with similar scale and can be fine-tuned like any connected layer; the
+// first starts with a zero bias that trains like any other, the second
+// keeps the old one. Layer indices after i
+// shift by one, so activation checkpoints are cleared and a flash
+// checkpoint has to be reopened. A packed net is repacked, the two new
+// layers start without optimizer state and the others keep theirs. A
+// batchnorm folded into layer i moves to the second factor, which makes
+// the same outputs, so unfold_batchnorm_net still works.
+// net *m: network to change
+// int i: index of a connected layer
+// int rank: rank to keep, or <= 0 to choose it from energy
+// float energy: fraction of the squared singular values to keep
+// returns: the rank used, -1 if layer i is not connected, the SVD did not
+//          converge or the factorization would not be smaller than w
+int factorize_layer(net *m, int i, int rank, float energy)
+{
+    layer d = m->layers[i];
+    if(d.type != CONNECTED_LAYER) return -1;
+    int inputs = d.w.rows;
+    int outputs = d.w.cols;
+    matrix u, s, v;
+    int status = svd_matrix(d.w, &u, &s, &v);
+    if(rank <= 0) rank = energy_rank(s, energy);
+    if(rank > s.cols) rank = s.cols;
+    if(status || rank*(inputs + outputs) >= inputs*outputs){
+        free_matrix(u);
+        free_matrix(s);
+        free_matrix(v);
+        return -1;
+    }
+
+    layer a = make_connected_layer(inputs, rank);
+    layer b = make_connected_layer(rank, outputs);
+    int j, k;
+    for(k = 0; k < rank; ++k){
+        float root = sqrtf(s.data[k]);
+        for(j = 0; j < inputs; ++j) a.w.data[j*rank + k] = u.data[j*u.cols + k]*root;
+        for(j = 0; j < outputs; ++j) b.w.data[k*outputs + j] = v.data[j*v.cols + k]*root;
+    }
+    memcpy(b.b.data, d.b.data, outputs*sizeof(float));
+    b.folded = d.folded;
+    d.folded = 0;
+    a.freeze = b.freeze = d.freeze;
+    a.dirty = b.dirty = 1;
+    free_matrix(u);
+    free_matrix(s);
+    free_matrix(v);
+
+    if(m->checkpoint) clear_checkpoints(m);
+    layer *layers = calloc(m->n + 1, sizeof(layer));
+    memcpy(layers, m->layers, i*sizeof(layer));
+    layers[i] = a;
+    layers[i+1] = b;
+    memcpy(layers + i + 2, m->layers + i + 1, (m->n - i - 1)*sizeof(layer));
+    free_layer(d);
+    free(m->layers);
+    m->layers = layers;
+    ++m->n;
+    if(m->arena) pack_net(m);
+    return rank;
+}
@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "uwnet.h"
+
+#if defined(__ZEPHYR__) && defined(CONFIG_FLASH_MAP)
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/drivers/flash.h>
+#endif
+
+// Store layout, every region starts on an erase block:
+//   commit record A | commit record B | layer 0 slot 0 | layer 0 slot 1 | ...
+// Only dirty layers are written, always into the slot that is not live,
+// and a new commit record then goes into the record block that is not
+// live. Power loss at any point leaves the previous record and every slot
+// it points to intact.
+#define CHECKPOINT_MAGIC 0x4b43544d
+#define CHECKPOINT_RECORDS 2
+#define CHECKPOINT_CHUNK 256
+
+typedef struct{
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t layers;
+    uint32_t crc;       // over the entries
+} checkpoint_record;
+
+uint32_t align_up(uint32_t n, uint32_t a)
+{
+    return (n + a-1) / a * a;
+}
+
+// Bytes of parameters and statistics a layer stores
+uint32_t layer_bytes(layer *l)
+{
+    matrix *t[4];
+    int kind[4];
+    int i;
+    int k = layer_tensors(l, t, kind);
+    uint32_t bytes = 0;
+    for(i = 0; i < k; ++i){
+        bytes += t[i]->rows*t[i]->cols*sizeof(float);
+    }
+    return bytes;
+}
+
+// Read a commit record and check it
+// returns: 0 if it is valid for this layout
+int read_record(checkpoint *c, int r, checkpoint_record *h, checkpoint_entry *entries)
+{
+    checkpoint_store *s = c->store;
+    uint32_t offset = r*s->erase_size;
+    if(s->read(s, offset, h, sizeof(*h))) return -1;
+    if(h->magic != CHECKPOINT_MAGIC || h->layers != (uint32_t)c->n) return -1;
+    if(s->read(s, offset + sizeof(*h), entries, c->n*sizeof(checkpoint_entry))) return -1;
+    if(crc32_update(0, entries, c->n*sizeof(checkpoint_entry)) != h->crc) return -1;
+    return 0;
+}
+
+// Set up checkpointing of a net to a store and find the newest valid
+// commit record in it
+// checkpoint *c: checkpoint to initialize
+// checkpoint_store *s: store to use
+// net m: network, only its layout is used
+// returns: 0 if a previous checkpoint was found, 1 if the store is empty,
+//          -1 if the net does not fit in the store
+int open_checkpoint(checkpoint *c, checkpoint_store *s, net m)
+{
+    int i;
+    memset(c, 0, sizeof(*c));
+    c->store = s;
+    c->n = m.n;
+    c->record = -1;
+    c->slot_offset = calloc(m.n ? m.n : 1, sizeof(uint32_t));
+    c->slot_size = calloc(m.n ? m.n : 1, sizeof(uint32_t));
+    c->entries = calloc(m.n ? m.n : 1, sizeof(checkpoint_entry));
+
+    uint32_t record_size = sizeof(checkpoint_record) + m.n*sizeof(checkpoint_entry);
+    uint32_t offset = CHECKPOINT_RECORDS*s->erase_size;
+    if(record_size > s->erase_size) return -1;
+    for(i = 0; i < m.n; ++i){
+        c->slot_offset[i] = offset;
+        c->slot_size[i] = align_up(layer_bytes(&m.layers[i]), s->erase_size);
+        offset += 2*c->slot_size[i];
+    }
+    if(offset > s->size) return -1;
+
+    checkpoint_record h;
+    checkpoint_entry *entries = calloc(m.n ? m.n : 1, sizeof(checkpoint_entry));
+    int r;
+    for(r = 0; r < CHECKPOINT_RECORDS; ++r){
+        if(read_record(c, r, &h, entries)) continue;
+        if(c->record < 0 || h.sequence > c->sequence){
+            c->record = r;
+            c->sequence = h.sequence;
+            memcpy(c->entries, entries, m.n*sizeof(checkpoint_entry));
+        }
+    }
+    free(entries);
+    return c->record < 0;
+}
+
+// Buffered writer that keeps writes aligned for flash
+typedef struct{
+    checkpoint_store *s;
+    uint32_t offset;
+    uint32_t fill;
+    uint8_t buf[CHECKPOINT_CHUNK];
+} chunk_writer;
+
+int flush_chunk(chunk_writer *w)
+{
+    if(!w->fill) return 0;
+    uint32_t size = align_up(w->fill, w->s->write_align);
+    memset(w->buf + w->fill, 0xff, size - w->fill);
+    int err = w->s->write(w->s, w->offset, w->buf, size);
+    w->offset += size;
+    w->fill = 0;
+    return err;
+}
+
+int write_chunked(chunk_writer *w, const void *data, uint32_t n)
+{
+    const uint8_t *p = data;
+    while(n){
+        uint32_t k = CHECKPOINT_CHUNK - w->fill;
+        if(k > n) k = n;
+        memcpy(w->buf + w->fill, p, k);
+        w->fill += k;
+        p += k;
+        n -= k;
+        if(w->fill == CHECKPOINT_CHUNK && flush_chunk(w)) return -1;
+    }
+    return 0;
+}
+
+// Write every layer whose parameters changed since the last checkpoint,
+// then commit. Layers that never made it to the store are written too.
+// Slots are sized when the checkpoint is opened, so after a layer grows
+// or the net changes its layer count (e.g. factorize_layer) the
+// checkpoint has to be closed and opened again.
+// checkpoint *c: checkpoint opened for this net
+// net m: network to save, dirty flags are cleared
+// returns: number of layers written, -1 on a storage error or if the net
+//          no longer fits the layout, in which case the store is untouched
+int save_checkpoint(checkpoint *c, net m)
+{
+    checkpoint_store *s = c->store;
+    int i, j;
+    int written = 0;
+    if(m.n != c->n) return -1;
+    for(i = 0; i < c->n; ++i){
+        if(layer_bytes(&m.layers[i]) > c->slot_size[i]) return -1;
+    }
+    checkpoint_entry *entries = calloc(c->n ? c->n : 1, sizeof(checkpoint_entry));
+    memcpy(entries, c->entries, c->n*sizeof(checkpoint_entry));
+
+    for(i = 0; i < c->n; ++i){
+        layer *l = &m.layers[i];
+        uint32_t bytes = layer_bytes(l);
+        int stored = c->record >= 0 && entries[i].bytes == bytes;
+        if(!bytes || (stored && !l->dirty)) continue;
+
+        // Never the live slot, even if the layer changed size
+        uint32_t slot = c->record >= 0 ? !entries[i].slot : 0;
+        uint32_t offset = c->slot_offset[i] + slot*c->slot_size[i];
+        if(s->erase(s, offset, c->slot_size[i])) goto fail;
+
+        chunk_writer w = {0};
+        w.s = s;
+        w.offset = offset;
+        matrix *t[4];
+        int kind[4];
+        int k = layer_tensors(l, t, kind);
+        uint32_t crc = 0;
+        for(j = 0; j < k; ++j){
+            uint32_t n = t[j]->rows*t[j]->cols*sizeof(float);
+            crc = crc32_update(crc, t[j]->data, n);
+            if(write_chunked(&w, t[j]->data, n)) goto fail;
+        }
+        if(flush_chunk(&w)) goto fail;
+
+        entries[i].slot = slot;
+        entries[i].bytes = bytes;
+        entries[i].crc = crc;
+        ++written;
+    }
+    if(!written && c->record >= 0){
+        free(entries);
+        return 0;
+    }
+
+    // Commit into the record block that is not live
+    checkpoint_record h;
+    h.magic = CHECKPOINT_MAGIC;
+    h.sequence = c->sequence + 1;
+    h.layers = c->n;
+    h.crc = crc32_update(0, entries, c->n*sizeof(checkpoint_entry));
+    int r = (c->record + 1) % CHECKPOINT_RECORDS;
+    uint32_t offset = r*s->erase_size;
+    if(s->erase(s, offset, s->erase_size)) goto fail;
+    chunk_writer w = {0};
+    w.s = s;
+    w.offset = offset;
+    if(write_chunked(&w, &h, sizeof(h))) goto fail;
+    if(write_chunked(&w, entries, c->n*sizeof(checkpoint_entry))) goto fail;
+    if(flush_chunk(&w)) goto fail;
+
+    c->record = r;
+    c->sequence = h.sequence;
+    memcpy(c->entries, entries, c->n*sizeof(checkpoint_entry));
+    for(i = 0; i < c->n; ++i){
+        m.layers[i].dirty = 0;
+    }
+    free(entries);
+    return written;
+
+fail:
+    free(entries);
+    return -1;
+}
+
+// Load the last committed checkpoint into a net
+// returns: 0 on success, -1 if there is none, the layout changed or a
+//          layer fails its CRC
+int restore_checkpoint(checkpoint *c, net m)
+{
+    checkpoint_store *s = c->store;
+    int i, j;
+    if(c->record < 0 || m.n != c->n) return -1;
+    for(i = 0; i < c->n; ++i){
+        layer *l = &m.layers[i];
+        uint32_t bytes = layer_bytes(l);
+        if(!bytes) continue;
+        if(c->entries[i].bytes != bytes) return -1;
+
+        uint32_t offset = c->slot_offset[i] + c->entries[i].slot*c->slot_size[i];
+        matrix *t[4];
+        int kind[4];
+        int k = layer_tensors(l, t, kind);
+        uint32_t crc = 0;
+        for(j = 0; j < k; ++j){
+            uint32_t n = t[j]->rows*t[j]->cols*sizeof(float);
+            if(s->read(s, offset, t[j]->data, n)) return -1;
+            crc = crc32_update(crc, t[j]->data, n);
+            offset += n;
+        }
+        if(crc != c->entries[i].crc) return -1;
+        l->dirty = 0;
+        invalidate_weight_caches(*l);
+    }
+    return 0;
+}
+
+void close_checkpoint(checkpoint *c)
+{
+    free(c->slot_offset);
+    free(c->slot_size);
+    free(c->entries);
+    memset(c, 0, sizeof(*c));
+}
+
+int file_store_read(checkpoint_store *s, uint32_t offset, void *data, uint32_t size)
+{
+    FILE *fp = s->ctx;
+    if(fseek(fp, offset, SEEK_SET)) return -1;
+    return fread(data, 1, size, fp) == size ? 0 : -1;
+}
+
+int file_store_write(checkpoint_store *s, uint32_t offset, const void *data, uint32_t size)
+{
+    FILE *fp = s->ctx;
+    if(fseek(fp, offset, SEEK_SET)) return -1;
+    if(fwrite(data, 1, size, fp) != size) return -1;
+    return fflush(fp);
+}
+
+int file_store_erase(checkpoint_store *s, uint32_t offset, uint32_t size)
+{
+    uint8_t ff[CHECKPOINT_CHUNK];
+    memset(ff, 0xff, sizeof(ff));
+    FILE *fp = s->ctx;
+    if(fseek(fp, offset, SEEK_SET)) return -1;
+    while(size){
+        uint32_t k = size < sizeof(ff) ? size : sizeof(ff);
+        if(fwrite(ff, 1, k, fp) != k) return -1;
+        size -= k;
+    }
+    return fflush(fp);
+}
+
+// Use a file as checkpoint store, e.g. on the host or a filesystem
+// char *filename: file to use, created erased if it does not exist
+// uint32_t size: size of the store
+// uint32_t erase_size: erase block size to emulate
+// returns: 0 on success, -1 if the file can't be opened
+int open_file_store(checkpoint_store *s, char *filename, uint32_t size, uint32_t erase_size)
+{
+    memset(s, 0, sizeof(*s));
+    FILE *fp = fopen(filename, "r+b");
+    if(!fp){
+        fp = fopen(filename, "w+b");
+        if(!fp) return -1;
+    }
+    s->read = file_store_read;
+    s->write = file_store_write;
+    s->erase = file_store_erase;
+    s->size = size;
+    s->erase_size = erase_size;
+    s->write_align = 1;
+    s->ctx = fp;
+
+    fseek(fp, 0, SEEK_END);
+    long have = ftell(fp);
+    if(have < (long)size) file_store_erase(s, have, size - have);
+    return 0;
+}
+
+void close_file_store(checkpoint_store *s)
+{
+    if(s->ctx) fclose(s->ctx);
+    s->ctx = 0;
+}
+
+#if defined(__ZEPHYR__) && defined(CONFIG_FLASH_MAP)
+int flash_store_read(checkpoint_store *s, uint32_t offset, void *data, uint32_t size)
+{
+    return flash_area_read(s->ctx, offset, data, size);
+}
+
+int flash_store_write(checkpoint_store *s, uint32_t offset, const void *data, uint32_t size)
+{
+    return flash_area_write(s->ctx, offset, data, size);
+}
+
+int flash_store_erase(checkpoint_store *s, uint32_t offset, uint32_t size)
+{
+    return flash_area_erase(s->ctx, offset, size);
+}
+
+// Use a flash partition as checkpoint store. Needs CONFIG_FLASH and
+// CONFIG_FLASH_MAP; on native_sim this runs on the flash simulator.
+// int area_id: partition, e.g. FIXED_PARTITION_ID(storage_partition)
+// returns: 0 on success, negative errno otherwise
+int open_flash_store(checkpoint_store *s, int area_id)
+{
+    const struct flash_area *fa;
+    struct flash_pages_info info;
+    memset(s, 0, sizeof(*s));
+    int err = flash_area_open(area_id, &fa);
+    if(err) return err;
+    const struct device *dev = flash_area_get_device(fa);
+    err = flash_get_page_info_by_offs(dev, fa->fa_off, &info);
+    if(err){
+        flash_area_close(fa);
+        return err;
+    }
+    s->read = flash_store_read;
+    s->write = flash_store_write;
+    s->erase = flash_store_erase;
+    s->size = fa->fa_size;
+    s->erase_size = info.size;
+    s->write_align = flash_get_write_block_size(dev);
+    s->ctx = (void *)fa;
+    return 0;
+}
+#else
+int open_flash_store(checkpoint_store *s, int area_id)
+{
+    (void) s;
+    (void) area_id;
+    return -1;
+}
+#endif
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "s8_net.h"
+#include "parameters.h"
+#include "weights.h"
+
+static const int8_t conv1_wt[CONV1_WT_SHAPE] = CONV1_WT;
+static const int8_t conv1_bias[CONV1_BIAS_SHAPE] = CONV1_BIAS;
+static const int8_t conv2_wt[CONV2_WT_SHAPE] = CONV2_WT;
+static const int8_t conv2_bias[CONV2_BIAS_SHAPE] = CONV2_BIAS;
+static const int8_t conv3_wt[CONV3_WT_SHAPE] = CONV3_WT;
+static const int8_t conv3_bias[CONV3_BIAS_SHAPE] = CONV3_BIAS;
+static const int8_t interface_wt[INTERFACE_WT_SHAPE] = INTERFACE_WT;
+static const int8_t interface_bias[INTERFACE_BIAS_SHAPE] = INTERFACE_BIAS;
+
+// Reorder one example between the float layout [channel][y][x] and the
+// int8 layout [y][x][channel]
+// int to_hwc: 1 for CHW to HWC, 0 for HWC to CHW
+void reorder_hwc(const float *x, float *y, int spatial, int c, int to_hwc)
+{
+    int i, j;
+    for(i = 0; i < spatial; ++i){
+        for(j = 0; j < c; ++j){
+            if(to_hwc) y[i*c + j] = x[j*spatial + i];
+            else       y[j*spatial + i] = x[i*c + j];
+        }
+    }
+}
+
+// Run int8 stages on float input
+// layer l: int8 layer, filters is the number of outputs
+// matrix x: input to layer, one CHW image per row
+// returns: dequantized output, CHW if the last stage is spatial
+matrix forward_int8_layer(layer l, matrix x)
+{
+    int8_backbone *bb = l.int8;
+    s8_stage *last = &bb->stages[bb->n-1];
+    int inputs = l.width*l.height*l.channels;
+    int spatial = last->output_dims.h*last->output_dims.w;
+    assert(x.cols == inputs);
+
+    matrix y = l.out ? view_matrix(l.out, x.rows, l.filters) : make_matrix(x.rows, l.filters);
+    int i;
+    for(i = 0; i < x.rows; ++i){
+        float *out = y.data + i*y.cols;
+        reorder_hwc(x.data + i*x.cols, bb->hwc, l.width*l.height, l.channels, 1);
+        quantize_buffer(bb->hwc, bb->in, inputs, bb->input_q);
+        run_s8_stages(bb->stages, bb->n, &bb->buffers, bb->in, bb->q);
+        if(last->type == S8_FC){
+            dequantize_buffer(bb->q, out, l.filters, bb->out_q);
+        } else {
+            dequantize_buffer(bb->q, bb->hwc, l.filters, bb->out_q);
+            reorder_hwc(bb->hwc, out, spatial, last->output_dims.c, 0);
+        }
+    }
+    return y;
+}
+
+// Int8 layers are never trained, backward_net stops above them
+matrix backward_int8_layer(layer l, matrix dy)
+{
+    matrix none = {0};
+    return none;
+}
+
+void update_int8_layer(layer l, optimizer *o){}
+
+// Set up a backbone over caller owned stages
+// s8_stage *stages: stages to run, in order
+// int input_q, out_q: fractional bits of the float boundary on either end
+void make_int8_backbone(int8_backbone *bb, s8_stage *stages, int n, int input_q, int out_q)
+{
+    int inputs = stages[0].input_dims.h*stages[0].input_dims.w*stages[0].input_dims.c;
+    int outputs = s8_stage_outputs(&stages[n-1]);
+    bb->stages = stages;
+    bb->n = n;
+    bb->input_q = input_q;
+    bb->out_q = out_q;
+    bb->in = calloc(inputs, sizeof(int8_t));
+    bb->q = calloc(outputs, sizeof(int8_t));
+    bb->hwc = calloc(inputs > outputs ? inputs : outputs, sizeof(float));
+    make_s8_buffers(&bb->buffers, stages, n);
+    bb->owned = 0;
+}
+
+// The CONV1..INTERFACE feature extractor from weights.h and parameters.h:
+// three conv, relu, max pool blocks and the interface fully connected
+// layer, whose INTERFACE_OUT outputs feed a float head
+void make_cifar_backbone(int8_backbone *bb)
+{
+    s8_stage *s = calloc(7, sizeof(s8_stage));
+    make_s8_conv_from_q7(&s[0], conv1_wt, conv1_bias, CONV1_IM_DIM, CONV1_IM_CH, CONV1_OUT_CH,
+            CONV1_KER_DIM, CONV1_PADDING, CONV1_STRIDE, CONV1_OUT_DIM,
+            CONV1_BIAS_LSHIFT, CONV1_OUT_RSHIFT, 1);
+    make_s8_maxpool(&s[1], POOL1_IM_DIM, POOL1_IM_CH, POOL1_KER_DIM, POOL1_PADDING, POOL1_STRIDE, POOL1_OUT_DIM);
+    make_s8_conv_from_q7(&s[2], conv2_wt, conv2_bias, CONV2_IM_DIM, CONV2_IM_CH, CONV2_OUT_CH,
+            CONV2_KER_DIM, CONV2_PADDING, CONV2_STRIDE, CONV2_OUT_DIM,
+            CONV2_BIAS_LSHIFT, CONV2_OUT_RSHIFT, 1);
+    make_s8_maxpool(&s[3], POOL2_IM_DIM, POOL2_IM_CH, POOL2_KER_DIM, POOL2_PADDING, POOL2_STRIDE, POOL2_OUT_DIM);
+    make_s8_conv_from_q7(&s[4], conv3_wt, conv3_bias, CONV3_IM_DIM, CONV3_IM_CH, CONV3_OUT_CH,
+            CONV3_KER_DIM, CONV3_PADDING, CONV3_STRIDE, CONV3_OUT_DIM,
+            CONV3_BIAS_LSHIFT, CONV3_OUT_RSHIFT, 1);
+    make_s8_maxpool(&s[5], POOL3_IM_DIM, POOL3_IM_CH, POOL3_KER_DIM, POOL3_PADDING, POOL3_STRIDE, POOL3_OUT_DIM);
+    make_s8_fc_from_q7(&s[6], interface_wt, interface_bias, INTERFACE_DIM, INTERFACE_OUT,
+            INTERFACE_BIAS_LSHIFT, INTERFACE_OUT_RSHIFT, 0);
+    make_int8_backbone(bb, s, 7, CONV1_INPUT_Q, INTERFACE_OUT_Q);
+    bb->owned = 1;
+}
+
+// Free the buffers of a backbone. Stages made by make_cifar_backbone are
+// freed too, stages passed to make_int8_backbone belong to the caller.
+void free_int8_backbone(int8_backbone *bb)
+{
+    int i;
+    if(bb->owned){
+        for(i = 0; i < bb->n; ++i){
+            free_s8_stage(&bb->stages[i]);
+        }
+        free(bb->stages);
+    }
+    free(bb->in);
+    free(bb->q);
+    free(bb->hwc);
+    free_s8_buffers(&bb->buffers);
+    memset(bb, 0, sizeof(*bb));
+}
+
+// Make a frozen layer that runs a backbone, so a net can put int8
+// feature extraction in front of trainable float layers
+// int8_backbone *bb: backbone to run, must outlive the layer
+layer make_int8_layer(int8_backbone *bb)
+{
+    s8_stage *first = &bb->stages[0];
+    layer l = {0};
+    l.type = INT8_LAYER;
+    l.width = first->input_dims.w;
+    l.height = first->input_dims.h;
+    l.channels = first->input_dims.c;
+    l.filters = s8_stage_outputs(&bb->stages[bb->n-1]);
+    l.freeze = 1;
+    l.int8 = bb;
+    l.forward  = forward_int8_layer;
+    l.backward = backward_int8_layer;
+    l.update   = update_int8_layer;
+    return l;
+}
@@ -1,41 +1,383 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
 #include "uwnet.h"
 
+// Arena tensors start on 32 byte boundaries, one Cortex-M7 cache line
+#define ARENA_ALIGN 8
+
+// Number of outputs per example of a layer
+// layer l: layer to check
+// int inputs: number of inputs per example
+int layer_outputs(layer l, int inputs)
+{
+    if (l.type == CONNECTED_LAYER) return l.w.cols;
+    if (l.type == CONVOLUTIONAL_LAYER || l.type == DEPTHWISE_LAYER) {
+        int outw = (l.width - l.size)/l.stride + 1;
+        int outh = (l.height - l.size)/l.stride + 1;
+        return outw*outh*l.filters;
+    }
+    if (l.type == CONV1D_LAYER) return (l.width - l.size + 1)*l.filters;
+    if (l.type == INT8_LAYER) return l.filters;
+    if (l.type == SPARSE_LAYER) return l.sparse->outputs;
+    return inputs;
+}
+
+// Run a net without keeping anything for backward. Layers write into two
+// ping-pong buffers sized for the largest activation, and elementwise
+// layers work in place, so memory is bounded by the two largest outputs.
+// net m: network to run
+// matrix input: input to the network, left untouched
+// returns: network output, owned by the caller
+matrix forward_net_inference(net m, matrix input)
+{
+    int i;
+    int cols = input.cols;
+    int max = 0;
+    for (i = 0; i < m.n; ++i) {
+        cols = layer_outputs(m.layers[i], cols);
+        if (cols > max) max = cols;
+    }
+    if (m.n == 0) return copy_matrix(input);
+
+    float *buf[2];
+    buf[0] = calloc(input.rows*max, sizeof(float));
+    buf[1] = calloc(input.rows*max, sizeof(float));
+
+    matrix x = input;
+    for (i = 0; i < m.n; ++i) {
+        layer l = m.layers[i];
+        int elementwise = l.type == ACTIVATION_LAYER || l.type == BATCHNORM_LAYER;
+        l.inference = 1;
+        l.nosave = 1;
+        if (elementwise && x.data != input.data) l.out = x.data;
+        else l.out = (x.data == buf[0]) ? buf[1] : buf[0];
+        x = l.forward(l, x);
+    }
+
+    // Hand the buffer holding the result to the caller
+    free(x.data == buf[0] ? buf[1] : buf[0]);
+    x.shallow = 0;
+    return x;
+}
+
 matrix forward_net(net m, matrix input)
 {
+    if (m.inference) return forward_net_inference(m, input);
+
     int i;
-    matrix x = copy_matrix(input);
+    int last = last_checkpoint(m);
+    matrix x = input;
     for (i = 0; i < m.n; ++i) {
         layer l = m.layers[i];
+        // Under checkpointing only the last segment saves its state, the
+        // others keep a copy of their first input to recompute from
+        if (m.checkpoint && i < last) {
+            l.nosave = 1;
+            if (m.checkpoint[i] || i == 0) {
+                free_matrix(m.saved[i]);
+                m.saved[i] = copy_matrix(x);
+            }
+        }
+        // Never let an in-place layer overwrite the caller's input
+        if (l.inplace && x.data == input.data) x = copy_matrix(input);
         matrix y = l.forward(l, x);
 
-        free_matrix(x);
+        // In-place layers hand back the buffer they were given
+        if (y.data != x.data && x.data != input.data) free_matrix(x);
         x = y;
     }
+    if (x.data == input.data) x = copy_matrix(input);
     return x;
 }
 
+// Index of the first layer with parameters left to train, m.n if none
+int first_trainable_layer(net m)
+{
+    int i;
+    for (i = 0; i < m.n; ++i) {
+        if (m.layers[i].w.data && !m.layers[i].freeze) return i;
+    }
+    return m.n;
+}
+
 void backward_net(net m, matrix d)
 {
+    // Nothing below the first trainable layer needs gradients, and that
+    // layer itself only needs its weight gradients
+    int first = first_trainable_layer(m);
+    int ready = last_checkpoint(m);
     matrix dy = copy_matrix(d);
     int i;
-    for (i = m.n-1; i >= 0; --i) {
+    for (i = m.n-1; i >= first; --i) {
+        // Rebuild the state of the segment this layer belongs to
+        if (m.checkpoint && i < ready) ready = recompute_segment(m, i);
+
         layer l = m.layers[i];
+        l.skip_dx = (i == first);
         matrix dx = l.backward(l, dy);
+        if (m.checkpoint) free_layer_state(l);
 
-        free_matrix(dy);
+        if (dx.data != dy.data) free_matrix(dy);
         dy = dx;
     }
     free_matrix(dy);
 }
 
+// Update every layer with SGD and momentum
 void update_net(net m, float rate, float momentum, float decay)
+{
+    optimizer o = make_sgd_optimizer(rate, momentum, decay);
+    optimize_net(m, &o);
+}
+
+// Check whether one pass over the arena updates exactly what the layers
+// would update themselves: every parameter lives in it and nothing is frozen
+int net_arena_covers_layers(net m)
+{
+    int i;
+    if(!m.arena) return 0;
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        if(l.freeze) return 0;
+        if(l.w.data && (l.w.data < m.params || l.w.data >= m.params + m.nparams)) return 0;
+        if(l.b.data && (l.b.data < m.params || l.b.data >= m.params + m.nparams)) return 0;
+    }
+    return 1;
+}
+
+// Allocate whatever optimizer state optimize_net will use under o
+// net m: network that will be updated
+// optimizer o: update rule
+void ensure_net_optimizer_state(net m, optimizer o)
+{
+    int i;
+    if(net_arena_covers_layers(m)){
+        ensure_optimizer_state(&m.state[0], o, m.ndecay);
+        ensure_optimizer_state(&m.state[1], o, m.nparams - m.ndecay);
+        return;
+    }
+    for(i = 0; i < m.n; ++i){
+        layer *l = &m.layers[i];
+        if(l->freeze) continue;
+        if(l->w.data) ensure_optimizer_state(&l->wstate, o, l->w.rows*l->w.cols);
+        if(l->b.data) ensure_optimizer_state(&l->bstate, o, l->b.rows*l->b.cols);
+    }
+}
+
+// Take one optimizer step over every layer
+// net m: network to update
+// optimizer *o: update rule, its step count is advanced
+void optimize_net(net m, optimizer *o)
+{
+    int i;
+    ++o->t;
+    for(i = 0; i < m.n; ++i){
+        layer *l = &m.layers[i];
+        // Batchnorm statistics move with every training forward pass
+        if((!l->freeze && (l->w.data || l->b.data)) || l->type == BATCHNORM_LAYER) l->dirty = 1;
+        if(!l->freeze) invalidate_weight_caches(*l);
+    }
+    ensure_net_optimizer_state(m, *o);
+    if(net_arena_covers_layers(m)){
+        int nrest = m.nparams - m.ndecay;
+        update_matrix(o, view_matrix(m.params, 1, m.ndecay),
+                view_matrix(m.grads, 1, m.ndecay), m.state[0], o->decay);
+        update_matrix(o, view_matrix(m.params + m.ndecay, 1, nrest),
+                view_matrix(m.grads + m.ndecay, 1, nrest), m.state[1], 0);
+        return;
+    }
+    for(i = 0; i < m.n; ++i){
+        layer *l = &m.layers[i];
+        if(l->freeze) continue;
+        l->update(*l, o);
+    }
+}
+
+int arena_size(matrix m)
+{
+    return (m.rows*m.cols + ARENA_ALIGN-1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+// Move a parameter tensor and its gradient into the arena
+// matrix *w, *dw: tensor and gradient, replaced by views
+// float *params, *grads: arena regions
+// int *offset: next free slot, advanced past the tensor
+void pack_matrix(matrix *w, matrix *dw, float *params, float *grads, int *offset)
+{
+    if(!w->data) return;
+    int n = w->rows*w->cols;
+    float *p = params + *offset;
+    float *g = grads + *offset;
+    memcpy(p, w->data, n*sizeof(float));
+    if(dw->data) memcpy(g, dw->data, n*sizeof(float));
+    free_matrix(*w);
+    free_matrix(*dw);
+    *w = view_matrix(p, w->rows, w->cols);
+    *dw = view_matrix(g, w->rows, w->cols);
+    *offset += arena_size(*w);
+}
+
+// Offset of a tensor in a net's arena
+// returns: the offset in floats, -1 if w does not live there
+int arena_offset(net m, matrix w)
+{
+    uintptr_t p = (uintptr_t)w.data;
+    uintptr_t base = (uintptr_t)m.params;
+    if(!m.arena || !w.data || !w.shallow) return -1;
+    if(p < base || p >= base + m.nparams*sizeof(float)) return -1;
+    return (p - base)/sizeof(float);
+}
+
+// Copy the optimizer state of one tensor between arenas
+// net *from, *to: nets before and after repacking, only offsets and state
+// int i, j: arena offsets of the tensor in from and to
+// int n: number of parameters
+void carry_arena_state(net *from, net *to, int i, int j, int n)
+{
+    optimizer_state *s = from->state[i >= from->ndecay];
+    optimizer_state *d = to->state[j >= to->ndecay];
+    if(!s || !d) return;
+    if(i >= from->ndecay) i -= from->ndecay;
+    if(j >= to->ndecay) j -= to->ndecay;
+    size_t size = s->half ? sizeof(uint16_t) : sizeof(float);
+    memcpy((char *)d->m + j*size, (char *)s->m + i*size, n*size);
+    if(s->v) memcpy((char *)d->v + j*size, (char *)s->v + i*size, n*size);
+}
+
+// Move every layer's parameters and gradients into one aligned parameter
+// buffer and one gradient buffer owned by the net. Weights that get decay
+// come first so the whole net can be updated in two passes. When repacking,
+// tensors that were already in the arena keep their optimizer state; new or
+// resized ones start from none, as a fresh optimizer would.
+// net *m: network to pack, can be called again after layers change
+void pack_net(net *m)
+{
+    int i;
+    int ndecay = 0;
+    int nparams = 0;
+    for(i = 0; i < m->n; ++i){
+        layer l = m->layers[i];
+        if(l.w.data){
+            if(l.type == BATCHNORM_LAYER) nparams += arena_size(l.w);
+            else ndecay += arena_size(l.w);
+        }
+        if(l.b.data) nparams += arena_size(l.b);
+    }
+    nparams += ndecay;
+
+    void *arena = calloc(2*nparams + ARENA_ALIGN, sizeof(float));
+    float *params = (float *)(((uintptr_t)arena + ARENA_ALIGN*sizeof(float) - 1)
+            & ~(uintptr_t)(ARENA_ALIGN*sizeof(float) - 1));
+    float *grads = params + nparams;
+
+    // Where each tensor was before, so its optimizer state can follow it
+    int *old = calloc(2*m->n + 1, sizeof(int));
+    for(i = 0; i < m->n; ++i){
+        old[2*i] = arena_offset(*m, m->layers[i].w);
+        old[2*i+1] = arena_offset(*m, m->layers[i].b);
+    }
+
+    int decay_offset = 0;
+    int offset = ndecay;
+    for(i = 0; i < m->n; ++i){
+        layer *l = &m->layers[i];
+        if(l->type == BATCHNORM_LAYER) pack_matrix(&l->w, &l->dw, params, grads, &offset);
+        else pack_matrix(&l->w, &l->dw, params, grads, &decay_offset);
+        pack_matrix(&l->b, &l->db, params, grads, &offset);
+    }
+
+    if(!m->state) m->state = calloc(2, sizeof(optimizer_state *));
+    optimizer_state *state[2] = {0};
+    net packed = *m;
+    packed.arena = arena;
+    packed.params = params;
+    packed.nparams = nparams;
+    packed.ndecay = ndecay;
+    packed.state = state;
+    for(i = 0; i < 2; ++i){
+        if(!m->state[i]) continue;
+        optimizer o = {0};
+        o.type = m->state[i]->type;
+        o.half = m->state[i]->half;
+        ensure_optimizer_state(&state[i], o, i ? nparams - ndecay : ndecay);
+    }
+    for(i = 0; i < m->n; ++i){
+        layer l = m->layers[i];
+        if(old[2*i] >= 0) carry_arena_state(m, &packed, old[2*i],
+                arena_offset(packed, l.w), l.w.rows*l.w.cols);
+        if(old[2*i+1] >= 0) carry_arena_state(m, &packed, old[2*i+1],
+                arena_offset(packed, l.b), l.b.rows*l.b.cols);
+    }
+    free(old);
+
+    free(m->arena);
+    free_optimizer_state(m->state[0]);
+    free_optimizer_state(m->state[1]);
+    m->state[0] = state[0];
+    m->state[1] = state[1];
+    m->arena = arena;
+    m->params = params;
+    m->grads = grads;
+    m->nparams = nparams;
+    m->ndecay = ndecay;
+}
+
+// Clear all accumulated gradients, one pass when the net is packed
+void zero_net_gradients(net m)
 {
     int i;
+    if(m.arena){
+        memset(m.grads, 0, m.nparams*sizeof(float));
+    }
     for(i = 0; i < m.n; ++i){
         layer l = m.layers[i];
-        l.update(l, rate, momentum, decay);
+        if(l.dw.data && !l.dw.shallow) scal_matrix(0, l.dw);
+        if(l.db.data && !l.db.shallow) scal_matrix(0, l.db);
+    }
+}
+
+// Stop training a layer and release its gradient and optimizer buffers
+// layer *l: layer to freeze
+void freeze_layer(layer *l)
+{
+    l->freeze = 1;
+    // Gradients living in the net's arena are not ours to free
+    if(!l->dw.shallow){
+        free_matrix(l->dw);
+        l->dw = (matrix){0};
+    }
+    if(!l->db.shallow){
+        free_matrix(l->db);
+        l->db = (matrix){0};
+    }
+    free_optimizer_state(l->wstate);
+    free_optimizer_state(l->bstate);
+    l->wstate = l->bstate = 0;
+}
+
+// Resume training a layer, reallocating its gradient buffers if needed
+// layer *l: layer to unfreeze
+void unfreeze_layer(layer *l)
+{
+    l->freeze = 0;
+    if(l->w.data && !l->dw.data) l->dw = make_matrix(l->w.rows, l->w.cols);
+    if(l->b.data && !l->db.data) l->db = make_matrix(l->b.rows, l->b.cols);
+}
+
+// Drop caches derived from w (Winograd filters, filter spectra), forward
+// rebuilds them. Call this whenever w changes outside of the optimizer.
+void invalidate_weight_caches(layer l)
+{
+    if(l.winograd){
+        free_matrix(*l.winograd);
+        *l.winograd = (matrix){0};
+    }
+    if(l.spectra){
+        free_matrix(*l.spectra);
+        *l.spectra = (matrix){0};
     }
 }
 
@@ -45,10 +387,41 @@ void free_layer(layer l)
     free_matrix(l.dw);
     free_matrix(l.b);
     free_matrix(l.db);
+    free_optimizer_state(l.wstate);
+    free_optimizer_state(l.bstate);
+    free_matrix(l.rolling_mean);
+    free_matrix(l.rolling_variance);
+    free_matrix(l.batch_mean);
+    free_matrix(l.batch_istd);
+    if(l.x_norm){
+        free_matrix(*l.x_norm);
+        free(l.x_norm);
+    }
     if(l.x){
         free_matrix(*l.x);
         free(l.x);
     }
+    if(l.mask){
+        free(l.mask->bits);
+        free(l.mask);
+    }
+    if(l.winograd){
+        free_matrix(*l.winograd);
+        free(l.winograd);
+    }
+    if(l.spectra){
+        free_matrix(*l.spectra);
+        free(l.spectra);
+    }
+    if(l.sparse){
+        free_matrix(l.sparse->row_ptr);
+        free_matrix(l.sparse->col_idx);
+        free(l.sparse);
+    }
+    if(l.folded){
+        free_layer(*l.folded);
+        free(l.folded);
+    }
 }
 
 void free_net(net n)
@@ -58,6 +431,19 @@ void free_net(net n)
         free_layer(n.layers[i]);
     }
     free(n.layers);
+    free(n.arena);
+    if(n.checkpoint){
+        for(i = 0; i < n.n; ++i){
+            free_matrix(n.saved[i]);
+        }
+        free(n.saved);
+        free(n.checkpoint);
+    }
+    if(n.state){
+        free_optimizer_state(n.state[0]);
+        free_optimizer_state(n.state[1]);
+        free(n.state);
+    }
 }
 
 void file_error(char *filename)
@@ -66,7 +452,9 @@ void file_error(char *filename)
     exit(-1);
 }
 
-void save_weights(net m, char *filename)
+// Headerless format: each layer's b then w as raw floats, see save_weights
+// for the self-describing one
+void save_weights_raw(net m, char *filename)
 {
     FILE *fp = fopen(filename, "wb");
     if(!fp) file_error(filename);
@@ -79,7 +467,7 @@ void save_weights(net m, char *filename)
     fclose(fp);
 }
 
-void load_weights(net m, char *filename)
+void load_weights_raw(net m, char *filename)
 {
     FILE *fp = fopen(filename, "rb");
     if(!fp) file_error(filename);
@@ -88,6 +476,55 @@ void load_weights(net m, char *filename)
         layer l = m.layers[i];
         if(l.b.data) read_matrix(l.b, fp);
         if(l.w.data) read_matrix(l.w, fp);
+        m.layers[i].dirty = 1;
+        invalidate_weight_caches(l);
+    }
+    fclose(fp);
+}
+
+// Write the packed parameters of a net in one go
+void save_parameters(net m, char *filename)
+{
+    if(!m.arena){
+        fprintf(stderr, "Net is not packed, use save_weights\n");
+        return;
+    }
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+    fwrite(&m.nparams, sizeof(int), 1, fp);
+    fwrite(&m.ndecay, sizeof(int), 1, fp);
+    fwrite(m.params, sizeof(float), m.nparams, fp);
+    fclose(fp);
+}
+
+// Read parameters written by save_parameters into a packed net of the
+// same architecture
+// returns: 0 on success, -1 if the file does not fit the net or is short
+int load_parameters(net m, char *filename)
+{
+    if(!m.arena){
+        fprintf(stderr, "Net is not packed, use load_weights\n");
+        return -1;
+    }
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) file_error(filename);
+    int nparams = 0;
+    int ndecay = 0;
+    int status = -1;
+    if(fread(&nparams, sizeof(int), 1, fp) != 1 || fread(&ndecay, sizeof(int), 1, fp) != 1
+            || nparams != m.nparams || ndecay != m.ndecay){
+        fprintf(stderr, "Parameter file %s does not match the net\n", filename);
+    } else if(fread(m.params, sizeof(float), m.nparams, fp) != (size_t)m.nparams){
+        fprintf(stderr, "Parameter file %s is truncated\n", filename);
+    } else {
+        status = 0;
+    }
+    // Even a short read may have changed some of the parameters
+    int i;
+    for(i = 0; i < m.n; ++i){
+        m.layers[i].dirty = 1;
+        invalidate_weight_caches(m.layers[i]);
     }
     fclose(fp);
+    return status;
 }
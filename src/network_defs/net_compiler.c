@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "uwnet.h"
+
+// Emit a float array as a constant
+void emit_floats(FILE *fp, char *name, int i, char *suffix, const float *x, int n)
+{
+    int k;
+    fprintf(fp, "static const float %s_l%d_%s[%d] = {", name, i, suffix, n);
+    for(k = 0; k < n; ++k){
+        fprintf(fp, "%s%s%.9ef", k ? "," : "", (k % 8) ? "" : "\n    ", x[k]);
+    }
+    fprintf(fp, "\n};\n");
+}
+
+void emit_connected(FILE *fp, char *name, int i, layer l, char *x, char *y)
+{
+    int in = l.w.rows;
+    int out = l.w.cols;
+    fprintf(fp, "    // %d: connected %d -> %d\n", i, in, out);
+    fprintf(fp, "    for(j = 0; j < %d; ++j) %s[j] = %s_l%d_b[j];\n", out, y, name, i);
+    fprintf(fp, "    for(k = 0; k < %d; ++k){\n", in);
+    fprintf(fp, "        float v = %s[k];\n", x);
+    fprintf(fp, "        const float *w = %s_l%d_w + k*%d;\n", name, i, out);
+    fprintf(fp, "        for(j = 0; j < %d; ++j) %s[j] += v*w[j];\n", out, y);
+    fprintf(fp, "    }\n");
+}
+
+// Direct convolution, the weights are read in their [filter][c][ky][kx]
+// order and no im2col buffer is needed
+void emit_convolutional(FILE *fp, char *name, int i, layer l, char *x, char *y)
+{
+    int outw = (l.width - l.size)/l.stride + 1;
+    int outh = (l.height - l.size)/l.stride + 1;
+    int k = l.size;
+    fprintf(fp, "    // %d: conv %dx%dx%d, %d %dx%d filters, stride %d\n",
+            i, l.width, l.height, l.channels, l.filters, k, k, l.stride);
+    fprintf(fp, "    for(f = 0; f < %d; ++f){\n", l.filters);
+    fprintf(fp, "        float *o = %s + f*%d;\n", y, outw*outh);
+    fprintf(fp, "        for(j = 0; j < %d; ++j) o[j] = %s_l%d_b[f];\n", outw*outh, name, i);
+    fprintf(fp, "        for(c = 0; c < %d; ++c){\n", l.channels);
+    fprintf(fp, "            const float *im = %s + c*%d;\n", x, l.width*l.height);
+    fprintf(fp, "            const float *w = %s_l%d_w + (f*%d + c)*%d;\n", name, i, l.channels, k*k);
+    fprintf(fp, "            for(ky = 0; ky < %d; ++ky){\n", k);
+    fprintf(fp, "                for(kx = 0; kx < %d; ++kx){\n", k);
+    fprintf(fp, "                    float v = w[ky*%d + kx];\n", k);
+    fprintf(fp, "                    for(oy = 0; oy < %d; ++oy){\n", outh);
+    fprintf(fp, "                        const float *row = im + (oy*%d + ky)*%d + kx;\n", l.stride, l.width);
+    fprintf(fp, "                        for(ox = 0; ox < %d; ++ox) o[oy*%d + ox] += v*row[ox*%d];\n", outw, outw, l.stride);
+    fprintf(fp, "                    }\n");
+    fprintf(fp, "                }\n");
+    fprintf(fp, "            }\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "    }\n");
+}
+
+void emit_depthwise(FILE *fp, char *name, int i, layer l, char *x, char *y)
+{
+    int outw = (l.width - l.size)/l.stride + 1;
+    int outh = (l.height - l.size)/l.stride + 1;
+    int k = l.size;
+    fprintf(fp, "    // %d: depthwise conv %dx%dx%d, %dx%d filters, stride %d\n",
+            i, l.width, l.height, l.channels, k, k, l.stride);
+    fprintf(fp, "    for(c = 0; c < %d; ++c){\n", l.channels);
+    fprintf(fp, "        float *o = %s + c*%d;\n", y, outw*outh);
+    fprintf(fp, "        const float *im = %s + c*%d;\n", x, l.width*l.height);
+    fprintf(fp, "        const float *w = %s_l%d_w + c*%d;\n", name, i, k*k);
+    fprintf(fp, "        for(j = 0; j < %d; ++j) o[j] = %s_l%d_b[c];\n", outw*outh, name, i);
+    fprintf(fp, "        for(ky = 0; ky < %d; ++ky){\n", k);
+    fprintf(fp, "            for(kx = 0; kx < %d; ++kx){\n", k);
+    fprintf(fp, "                float v = w[ky*%d + kx];\n", k);
+    fprintf(fp, "                for(oy = 0; oy < %d; ++oy){\n", outh);
+    fprintf(fp, "                    const float *row = im + (oy*%d + ky)*%d + kx;\n", l.stride, l.width);
+    fprintf(fp, "                    for(ox = 0; ox < %d; ++ox) o[oy*%d + ox] += v*row[ox*%d];\n", outw, outw, l.stride);
+    fprintf(fp, "                }\n");
+    fprintf(fp, "            }\n");
+    fprintf(fp, "        }\n");
+    fprintf(fp, "    }\n");
+}
+
+void emit_activation(FILE *fp, int i, layer l, int n, char *y)
+{
+    ACTIVATION a = l.activation;
+    fprintf(fp, "    // %d: activation\n", i);
+    if(a == RELU){
+        fprintf(fp, "    for(j = 0; j < %d; ++j) %s[j] = %s[j] > 0 ? %s[j] : 0;\n", n, y, y, y);
+    } else if(a == LRELU){
+        fprintf(fp, "    for(j = 0; j < %d; ++j) %s[j] = %s[j] > 0 ? %s[j] : .01f*%s[j];\n", n, y, y, y, y);
+    } else if(a == LOGISTIC){
+        fprintf(fp, "    for(j = 0; j < %d; ++j) %s[j] = 1/(1 + expf(-%s[j]));\n", n, y, y);
+    } else if(a == SOFTMAX){
+        fprintf(fp, "    {\n");
+        fprintf(fp, "        float sum = 0;\n");
+        fprintf(fp, "        for(j = 0; j < %d; ++j){\n", n);
+        fprintf(fp, "            %s[j] = expf(%s[j]);\n", y, y);
+        fprintf(fp, "            sum += %s[j];\n", y);
+        fprintf(fp, "        }\n");
+        fprintf(fp, "        for(j = 0; j < %d; ++j) %s[j] /= sum;\n", n, y);
+        fprintf(fp, "    }\n");
+    }
+}
+
+void emit_batchnorm(FILE *fp, char *name, int i, layer l, int n, char *y)
+{
+    fprintf(fp, "    // %d: batchnorm, inference statistics\n", i);
+    fprintf(fp, "    for(c = 0; c < %d; ++c){\n", l.channels);
+    fprintf(fp, "        float s = %s_l%d_w[c];\n", name, i);
+    fprintf(fp, "        float t = %s_l%d_b[c];\n", name, i);
+    fprintf(fp, "        for(j = 0; j < %d; ++j) %s[c*%d + j] = %s[c*%d + j]*s + t;\n",
+            n/l.channels, y, n/l.channels, y, n/l.channels);
+    fprintf(fp, "    }\n");
+}
+
+// Compile a trained net into a C file with one straight-line forward
+// function for a single example. Every shape is a literal, weights are
+// constant arrays and activations live in one static arena at fixed
+// offsets, so there is no dispatch, no heap and no shape arithmetic left
+// at runtime. Elementwise layers run in place.
+// The file defines NAME_INPUTS, NAME_OUTPUTS and
+//   void name_forward(const float *input, float *output);
+// net m: network to compile, batchnorm uses its rolling statistics
+// int inputs: inputs per example
+// char *name: prefix for everything the file defines
+// char *filename: C file to write
+// returns: 0 on success, -1 for a layer type that can't be compiled or
+//          a file error
+int compile_net(net m, int inputs, char *name, char *filename)
+{
+    int i;
+    int cols = inputs;
+    int max = inputs;
+    for(i = 0; i < m.n; ++i){
+        LAYER_TYPE t = m.layers[i].type;
+        if(t == INT8_LAYER || t == CONV1D_LAYER || t == SPARSE_LAYER) return -1;
+        cols = layer_outputs(m.layers[i], cols);
+        if(cols > max) max = cols;
+    }
+    int outputs = cols;
+
+    FILE *fp = fopen(filename, "w");
+    if(!fp) return -1;
+    fprintf(fp, "// Generated by compile_net, do not edit\n");
+    fprintf(fp, "#include <math.h>\n#include <string.h>\n\n");
+    fprintf(fp, "#define %s_INPUTS %d\n#define %s_OUTPUTS %d\n\n", name, inputs, name, outputs);
+    fprintf(fp, "void %s_forward(const float *input, float *output);\n\n", name);
+
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        if(l.type == CONNECTED_LAYER || l.type == CONVOLUTIONAL_LAYER || l.type == DEPTHWISE_LAYER){
+            emit_floats(fp, name, i, "w", l.w.data, l.w.rows*l.w.cols);
+            emit_floats(fp, name, i, "b", l.b.data, l.b.cols);
+        } else if(l.type == BATCHNORM_LAYER){
+            // Fold the statistics into one scale and shift per channel
+            float *s = calloc(l.channels, sizeof(float));
+            float *t = calloc(l.channels, sizeof(float));
+            int c;
+            for(c = 0; c < l.channels; ++c){
+                s[c] = l.w.data[c]/sqrtf(l.rolling_variance.data[c] + 0.00001f);
+                t[c] = l.b.data[c] - l.rolling_mean.data[c]*s[c];
+            }
+            emit_floats(fp, name, i, "w", s, l.channels);
+            emit_floats(fp, name, i, "b", t, l.channels);
+            free(s);
+            free(t);
+        }
+    }
+
+    // Ping-pong halves of the arena, the first layer reads the input
+    fprintf(fp, "\nstatic float %s_arena[%d];\n\n", name, 2*max);
+    fprintf(fp, "void %s_forward(const float *input, float *output)\n{\n", name);
+    fprintf(fp, "    int j, k, c, f, ky, kx, oy, ox;\n");
+    fprintf(fp, "    float *a = %s_arena;\n", name);
+    fprintf(fp, "    float *b = %s_arena + %d;\n", name, max);
+    fprintf(fp, "    (void) k; (void) c; (void) f; (void) ky; (void) kx; (void) oy; (void) ox; (void) b;\n");
+    fprintf(fp, "    memcpy(a, input, %d*sizeof(float));\n", inputs);
+
+    char *x = "a";
+    char *y = "b";
+    cols = inputs;
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        if(l.type == CONNECTED_LAYER || l.type == CONVOLUTIONAL_LAYER || l.type == DEPTHWISE_LAYER){
+            if(l.type == CONNECTED_LAYER) emit_connected(fp, name, i, l, x, y);
+            else if(l.type == CONVOLUTIONAL_LAYER) emit_convolutional(fp, name, i, l, x, y);
+            else emit_depthwise(fp, name, i, l, x, y);
+            char *t = x;
+            x = y;
+            y = t;
+        } else if(l.type == ACTIVATION_LAYER){
+            emit_activation(fp, i, l, cols, x);
+        } else if(l.type == BATCHNORM_LAYER){
+            emit_batchnorm(fp, name, i, l, cols, x);
+        }
+        cols = layer_outputs(l, cols);
+    }
+    fprintf(fp, "    memcpy(output, %s, %d*sizeof(float));\n}\n", x, outputs);
+    fclose(fp);
+    return 0;
+}
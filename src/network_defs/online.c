@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "uwnet.h"
+
+// Set up a learner for one example at a time. Everything learn_one
+// touches is allocated here, including optimizer state, so learn_one
+// itself never allocates.
+// learner *s: learner to set up
+// net m: network made of connected, activation and batchnorm layers;
+//        batchnorm runs on its rolling statistics, only scale and shift
+//        train. That matches forward_net on one example only where each
+//        batchnorm channel is a single value; a channel over several
+//        values is normalized by its batch statistics there instead.
+// int inputs: size of one example
+// optimizer *o: update rule, one step per example
+// returns: 0 on success, -1 if m has another kind of layer
+int make_learner(learner *s, net m, int inputs, optimizer *o)
+{
+    int i;
+    memset(s, 0, sizeof(learner));
+    for(i = 0; i < m.n; ++i){
+        LAYER_TYPE t = m.layers[i].type;
+        if(t != CONNECTED_LAYER && t != ACTIVATION_LAYER && t != BATCHNORM_LAYER) return -1;
+    }
+    s->m = m;
+    s->o = o;
+    s->first = first_trainable_layer(m);
+    s->size = calloc(m.n+1, sizeof(int));
+    s->act = calloc(m.n+1, sizeof(float *));
+
+    // One block for every activation, two for the gradients
+    int total = 0;
+    int max = inputs;
+    s->size[0] = inputs;
+    for(i = 0; i < m.n; ++i){
+        s->size[i+1] = layer_outputs(m.layers[i], s->size[i]);
+        if(s->size[i+1] > max) max = s->size[i+1];
+    }
+    for(i = 0; i <= m.n; ++i) total += s->size[i];
+    s->act[0] = calloc(total, sizeof(float));
+    for(i = 0; i < m.n; ++i) s->act[i+1] = s->act[i] + s->size[i];
+    s->grad[0] = calloc(max, sizeof(float));
+    s->grad[1] = calloc(max, sizeof(float));
+
+    // Work per call never depends on the data, so count it once
+    long ops = 0;
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        int in = s->size[i];
+        int out = s->size[i+1];
+        int params = l.w.rows*l.w.cols + l.b.rows*l.b.cols;
+        if(l.type == CONNECTED_LAYER){
+            ops += (long)in*out;
+            if(i >= s->first) ops += (long)(1 + (i > s->first))*in*out;
+        } else {
+            ops += out;
+            if(i >= s->first) ops += 2*out;
+        }
+        if(!l.freeze) ops += params;
+    }
+    s->ops = ops;
+
+    // So the first update doesn't allocate
+    ensure_net_optimizer_state(m, *o);
+    return 0;
+}
+
+// Forward one example through layer l
+// float *x: input, size in
+// float *y: output, size out
+void learner_forward(layer l, const float *x, float *y, int in, int out)
+{
+    int j, k;
+    if(l.type == CONNECTED_LAYER){
+        memcpy(y, l.b.data, out*sizeof(float));
+        for(k = 0; k < in; ++k){
+            float xk = x[k];
+            float *w = l.w.data + k*out;
+            for(j = 0; j < out; ++j) y[j] += xk*w[j];
+        }
+    } else if(l.type == BATCHNORM_LAYER){
+        int n = out / l.channels;
+        for(k = 0; k < l.channels; ++k){
+            float sc = l.w.data[k]/sqrtf(l.rolling_variance.data[k] + .00001f);
+            float sh = l.b.data[k] - l.rolling_mean.data[k]*sc;
+            for(j = 0; j < n; ++j) y[k*n + j] = x[k*n + j]*sc + sh;
+        }
+    } else {
+        ACTIVATION a = l.activation;
+        float sum = 0;
+        float max = x[0];
+        if(a == SOFTMAX) for(j = 1; j < out; ++j) if(x[j] > max) max = x[j];
+        for(j = 0; j < out; ++j){
+            float v = x[j];
+            if(a == LOGISTIC) y[j] = 1/(1+expf(-v));
+            else if(a == RELU) y[j] = (v>0) ? v : 0;
+            else if(a == LRELU) y[j] = (v>0) ? v : .01f*v;
+            else if(a == SOFTMAX) sum += y[j] = expf(v - max);
+            else y[j] = v;
+        }
+        if(a == SOFTMAX) for(j = 0; j < out; ++j) y[j] /= sum;
+    }
+}
+
+// Backward one example through layer l, accumulating into dw/db
+// float *x, *y: the layer's input and output from learner_forward
+// float *dy: dL/dy
+// float *dx: dL/dx, not written if null
+void learner_backward(layer l, const float *x, const float *y, const float *dy, float *dx, int in, int out)
+{
+    int j, k;
+    if(l.type == CONNECTED_LAYER){
+        if(!l.freeze) for(j = 0; j < out; ++j) l.db.data[j] += dy[j];
+        // One pass over w gives both dL/dw and dL/dx
+        for(k = 0; k < in; ++k){
+            float xk = x[k];
+            float *w = l.w.data + k*out;
+            float *dw = l.dw.data + k*out;
+            if(!l.freeze) for(j = 0; j < out; ++j) dw[j] += xk*dy[j];
+            if(dx){
+                float sum = 0;
+                for(j = 0; j < out; ++j) sum += w[j]*dy[j];
+                dx[k] = sum;
+            }
+        }
+    } else if(l.type == BATCHNORM_LAYER){
+        int n = out / l.channels;
+        for(k = 0; k < l.channels; ++k){
+            float istd = 1.f/sqrtf(l.rolling_variance.data[k] + .00001f);
+            float mean = l.rolling_mean.data[k];
+            for(j = 0; j < n; ++j){
+                float d = dy[k*n + j];
+                if(!l.freeze){
+                    l.db.data[k] += d;
+                    l.dw.data[k] += d*(x[k*n + j] - mean)*istd;
+                }
+                if(dx) dx[k*n + j] = d*l.w.data[k]*istd;
+            }
+        }
+    } else if(dx){
+        // Softmax passes dL/dy through, see backward_activation_layer
+        ACTIVATION a = l.activation;
+        for(j = 0; j < out; ++j){
+            float d = dy[j];
+            if(a == LOGISTIC) d *= y[j]*(1-y[j]);
+            else if(a == RELU) d *= (x[j] > 0) ? 1 : 0;
+            else if(a == LRELU) d *= (x[j] > 0) ? 1 : .01f;
+            dx[j] = d;
+        }
+    }
+}
+
+// Learn from a single labeled example: forward, backward and one
+// optimizer step. Nothing is allocated and the same s->ops operations run
+// every call, so the time per example is fixed for a given net. The loss
+// is cross-entropy after a softmax output, otherwise (y - onehot)^2/2.
+// learner *s: learner from make_learner
+// float *x: one example of s->size[0] features
+// int label: target class
+// returns: loss on the example before the update
+float learn_one(learner *s, const float *x, int label)
+{
+    net m = s->m;
+    int n = m.n;
+    int i, j;
+    memcpy(s->act[0], x, s->size[0]*sizeof(float));
+    for(i = 0; i < n; ++i){
+        learner_forward(m.layers[i], s->act[i], s->act[i+1], s->size[i], s->size[i+1]);
+    }
+
+    int outputs = s->size[n];
+    float *y = s->act[n];
+    float *dy = s->grad[0];
+    int softmax = n > 0 && m.layers[n-1].type == ACTIVATION_LAYER && m.layers[n-1].activation == SOFTMAX;
+    float loss = 0;
+    for(j = 0; j < outputs; ++j){
+        float t = (j == label);
+        dy[j] = y[j] - t;
+        if(!softmax) loss += .5f*dy[j]*dy[j];
+    }
+    if(softmax) loss = -logf(y[label] > 1e-12f ? y[label] : 1e-12f);
+    if(s->first >= n) return loss;
+
+    for(i = n-1; i >= s->first; --i){
+        float *dx = (i > s->first) ? s->grad[(n-i) & 1] : 0;
+        learner_backward(m.layers[i], s->act[i], s->act[i+1], dy, dx, s->size[i], s->size[i+1]);
+        dy = dx;
+    }
+    s->o->scale = 1;
+    optimize_net(m, s->o);
+    return loss;
+}
+
+void free_learner(learner *s)
+{
+    free(s->act ? s->act[0] : 0);
+    free(s->act);
+    free(s->size);
+    free(s->grad[0]);
+    free(s->grad[1]);
+    memset(s, 0, sizeof(learner));
+}
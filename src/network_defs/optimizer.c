@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include "uwnet.h"
+
+// Make a plain SGD optimizer with momentum, matching the old update rule
+// float rate: learning rate
+// float momentum: momentum term
+// float decay: l2 regularization term
+optimizer make_sgd_optimizer(float rate, float momentum, float decay)
+{
+    optimizer o = {0};
+    o.type = SGD;
+    o.rate = rate;
+    o.momentum = momentum;
+    o.decay = decay;
+    o.scale = 1;
+    return o;
+}
+
+// Make an Adam optimizer
+// float rate: learning rate
+// float beta1: decay of the first moment estimate, usually .9
+// float beta2: decay of the second moment estimate, usually .999
+// float decay: l2 regularization term
+optimizer make_adam_optimizer(float rate, float beta1, float beta2, float decay)
+{
+    optimizer o = {0};
+    o.type = ADAM;
+    o.rate = rate;
+    o.beta1 = beta1;
+    o.beta2 = beta2;
+    o.eps = 1e-7f;
+    o.decay = decay;
+    o.scale = 1;
+    return o;
+}
+
+// Make an RMSProp optimizer
+// float rate: learning rate
+// float alpha: decay of the mean square estimate, usually .9 or .99
+// float decay: l2 regularization term
+optimizer make_rmsprop_optimizer(float rate, float alpha, float decay)
+{
+    optimizer o = {0};
+    o.type = RMSPROP;
+    o.rate = rate;
+    o.beta2 = alpha;
+    o.eps = 1e-7f;
+    o.decay = decay;
+    o.scale = 1;
+    return o;
+}
+
+// Reduced precision state is kept as bfloat16, the top half of a float
+static inline float bf16_to_float(uint16_t h)
+{
+    union { uint32_t u; float f; } v;
+    v.u = (uint32_t)h << 16;
+    return v.f;
+}
+
+static inline uint16_t float_to_bf16(float f)
+{
+    union { uint32_t u; float f; } v;
+    v.f = f;
+    // Round to nearest even
+    v.u += 0x7fff + ((v.u >> 16) & 1);
+    return v.u >> 16;
+}
+
+static inline float get_state(void *s, int half, int i)
+{
+    return half ? bf16_to_float(((uint16_t *)s)[i]) : ((float *)s)[i];
+}
+
+static inline void set_state(void *s, int half, int i, float val)
+{
+    if (half) ((uint16_t *)s)[i] = float_to_bf16(val);
+    else ((float *)s)[i] = val;
+}
+
+// Number of state buffers each optimizer needs per parameter
+int optimizer_state_buffers(OPTIMIZER type)
+{
+    if (type == ADAM) return 2;
+    if (type == RMSPROP) return 1;
+    return 0;
+}
+
+// Make sure *s can hold state for n parameters under optimizer o,
+// reallocating it if the optimizer or precision changed
+// optimizer_state **s: state to check, allocated if null
+// optimizer o: optimizer the state is for
+// int n: number of parameters
+void ensure_optimizer_state(optimizer_state **s, optimizer o, int n)
+{
+    int buffers = optimizer_state_buffers(o.type);
+    optimizer_state *st = *s;
+    if (st && st->n == n && st->half == o.half && st->type == o.type) return;
+    free_optimizer_state(st);
+    *s = 0;
+    if (!buffers || !n) return;
+
+    size_t size = o.half ? sizeof(uint16_t) : sizeof(float);
+    st = calloc(1, sizeof(optimizer_state));
+    st->type = o.type;
+    st->n = n;
+    st->half = o.half;
+    st->m = calloc(n, size);
+    if (buffers > 1) st->v = calloc(n, size);
+    *s = st;
+}
+
+void free_optimizer_state(optimizer_state *s)
+{
+    if (!s) return;
+    free(s->m);
+    free(s->v);
+    free(s);
+}
+
+// Apply one optimizer step to a parameter tensor in a single pass
+// optimizer *o: optimizer to use, o->t is the current step
+// matrix w: parameters to update
+// matrix dw: accumulated gradients for w; for SGD this also holds the
+//            momentum term, otherwise it is cleared for the next step
+// optimizer_state *s: per-parameter state, null for SGD
+// float decay: l2 regularization term for this tensor
+void update_matrix(optimizer *o, matrix w, matrix dw, optimizer_state *s, float decay)
+{
+    int n = w.rows*w.cols;
+    int i;
+    float *wd = w.data;
+    float *g = dw.data;
+
+    if (o->type == SGD) {
+        // Same rule as before, dw += decay*w; w -= rate*dw; dw *= momentum,
+        // with the gradient scale folded into the rate
+        float rate = o->rate*o->scale;
+        float momentum = o->momentum;
+        for (i = 0; i < n; ++i) {
+            float d = g[i] + decay*wd[i];
+            wd[i] -= rate*d;
+            g[i] = momentum*d;
+        }
+    } else if (o->type == ADAM) {
+        float b1 = o->beta1;
+        float b2 = o->beta2;
+        float rate = o->rate*sqrtf(1 - powf(b2, o->t))/(1 - powf(b1, o->t));
+        int half = s->half;
+        for (i = 0; i < n; ++i) {
+            float d = g[i]*o->scale + decay*wd[i];
+            float m = b1*get_state(s->m, half, i) + (1-b1)*d;
+            float v = b2*get_state(s->v, half, i) + (1-b2)*d*d;
+            set_state(s->m, half, i, m);
+            set_state(s->v, half, i, v);
+            wd[i] -= rate*m/(sqrtf(v) + o->eps);
+            g[i] = 0;
+        }
+    } else if (o->type == RMSPROP) {
+        float a = o->beta2;
+        int half = s->half;
+        for (i = 0; i < n; ++i) {
+            float d = g[i]*o->scale + decay*wd[i];
+            float v = a*get_state(s->m, half, i) + (1-a)*d*d;
+            set_state(s->m, half, i, v);
+            wd[i] -= o->rate*d/(sqrtf(v) + o->eps);
+            g[i] = 0;
+        }
+    }
+}
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include "uwnet.h"
+
+// Keep blocks of rows of a matrix
+// matrix *m: matrix to shrink in place, nothing happens if it is empty
+// int *keep: indices of the blocks to keep, ascending
+// int n: number of blocks to keep
+// int block: rows per block
+void keep_row_blocks(matrix *m, const int *keep, int n, int block)
+{
+    if(!m->data) return;
+    int i, j;
+    matrix k = make_matrix(n*block, m->cols);
+    for(i = 0; i < n; ++i){
+        for(j = 0; j < block*m->cols; ++j){
+            k.data[i*block*m->cols + j] = m->data[keep[i]*block*m->cols + j];
+        }
+    }
+    free_matrix(*m);
+    *m = k;
+}
+
+// Keep blocks of columns of a matrix, see keep_row_blocks
+void keep_col_blocks(matrix *m, const int *keep, int n, int block)
+{
+    if(!m->data) return;
+    int r, i, j;
+    matrix k = make_matrix(m->rows, n*block);
+    for(r = 0; r < m->rows; ++r){
+        for(i = 0; i < n; ++i){
+            for(j = 0; j < block; ++j){
+                k.data[r*k.cols + i*block + j] = m->data[r*m->cols + keep[i]*block + j];
+            }
+        }
+    }
+    free_matrix(*m);
+    *m = k;
+}
+
+// Number of filters, output channels for conv layers and outputs for
+// connected layers, 0 for layers that have none
+int layer_filters(layer l)
+{
+    if(l.type == CONNECTED_LAYER) return l.w.cols;
+    if(l.type == CONVOLUTIONAL_LAYER || l.type == DEPTHWISE_LAYER || l.type == CONV1D_LAYER) return l.filters;
+    return 0;
+}
+
+// Score every filter of a layer, higher is more important
+// layer l: conv, depthwise, 1-D conv or connected layer
+// PRUNE_CRITERION c: PRUNE_L1 or PRUNE_L2 norm of the weights, or
+//     PRUNE_TAYLOR, |sum w*dw| per filter, which needs gradients from at
+//     least one backward pass
+// float *score: one entry per filter
+// returns: 0 on success, -1 for PRUNE_TAYLOR on a layer without gradients,
+//          e.g. a frozen one
+int score_filters(layer l, PRUNE_CRITERION c, float *score)
+{
+    int n = layer_filters(l);
+    int i, j;
+    if(c == PRUNE_TAYLOR && (l.freeze || !l.dw.data || !l.db.data)) return -1;
+    for(i = 0; i < n; ++i){
+        float s = 0;
+        int len = (l.type == CONNECTED_LAYER) ? l.w.rows : l.w.cols;
+        for(j = 0; j < len; ++j){
+            int k = (l.type == CONNECTED_LAYER) ? j*l.w.cols + i : i*l.w.cols + j;
+            float w = l.w.data[k];
+            if(c == PRUNE_L1) s += fabsf(w);
+            else if(c == PRUNE_L2) s += w*w;
+            else s += w*l.dw.data[k];
+        }
+        if(c == PRUNE_TAYLOR) s = fabsf(s + l.b.data[i]*l.db.data[i]);
+        score[i] = s;
+    }
+    return 0;
+}
+
+// Keep some channels of a batchnorm layer
+void prune_batchnorm_channels(layer *l, const int *keep, int n)
+{
+    keep_col_blocks(&l->w, keep, n, 1);
+    keep_col_blocks(&l->dw, keep, n, 1);
+    keep_col_blocks(&l->b, keep, n, 1);
+    keep_col_blocks(&l->db, keep, n, 1);
+    keep_col_blocks(&l->rolling_mean, keep, n, 1);
+    keep_col_blocks(&l->rolling_variance, keep, n, 1);
+    keep_col_blocks(&l->batch_mean, keep, n, 1);
+    keep_col_blocks(&l->batch_istd, keep, n, 1);
+    l->channels = n;
+}
+
+// Drop optimizer state that no longer matches the parameters, momentum
+// for SGD lives in dw and is pruned with it
+void reset_layer_state(layer *l)
+{
+    free_optimizer_state(l->wstate);
+    free_optimizer_state(l->bstate);
+    l->wstate = 0;
+    l->bstate = 0;
+    l->dirty = 1;
+    invalidate_weight_caches(*l);
+}
+
+// Remove filters from a layer and the matching inputs from the layers it
+// feeds: batchnorm and depthwise layers lose the same channels and pass
+// them on, the next conv, 1-D conv or connected layer loses the inputs.
+// Activation layers in between are shape agnostic. A depthwise layer
+// can't be pruned itself, its channels are set by the layer before it. A
+// packed net is repacked so the memory is given back. The changed layers
+// lose their optimizer state, the others keep theirs.
+// net *m: network to prune
+// int i: index of the layer to prune
+// int *keep: filters to keep, ascending
+// int n: number of filters to keep
+// returns: 0 on success, -1 if layer i has no filters to prune or feeds a
+//          layer that can't be rewritten, e.g. a sparse layer
+int prune_filters(net *m, int i, const int *keep, int n)
+{
+    layer *l = &m->layers[i];
+    int old = layer_filters(*l);
+    if(!old || l->type == DEPTHWISE_LAYER || n < 1 || n > old) return -1;
+
+    // Make sure whatever consumes the filters can be rewritten
+    int j;
+    for(j = i+1; j < m->n; ++j){
+        LAYER_TYPE t = m->layers[j].type;
+        if(t == ACTIVATION_LAYER || t == BATCHNORM_LAYER || t == DEPTHWISE_LAYER) continue;
+        if(t != CONVOLUTIONAL_LAYER && t != CONV1D_LAYER && t != CONNECTED_LAYER) return -1;
+        break;
+    }
+
+    int spatial = layer_outputs(*l, 0) / old;
+    if(l->type == CONNECTED_LAYER){
+        keep_col_blocks(&l->w, keep, n, 1);
+        keep_col_blocks(&l->dw, keep, n, 1);
+    } else {
+        keep_row_blocks(&l->w, keep, n, 1);
+        keep_row_blocks(&l->dw, keep, n, 1);
+        if(l->type == DEPTHWISE_LAYER) l->channels = n;
+        l->filters = n;
+    }
+    keep_col_blocks(&l->b, keep, n, 1);
+    keep_col_blocks(&l->db, keep, n, 1);
+    if(l->folded) prune_batchnorm_channels(l->folded, keep, n);
+    reset_layer_state(l);
+
+    for(j = i+1; j < m->n; ++j){
+        layer *next = &m->layers[j];
+        if(next->type == ACTIVATION_LAYER) continue;
+        if(next->type == BATCHNORM_LAYER){
+            prune_batchnorm_channels(next, keep, n);
+            reset_layer_state(next);
+            continue;
+        }
+        if(next->type == DEPTHWISE_LAYER){
+            keep_row_blocks(&next->w, keep, n, 1);
+            keep_row_blocks(&next->dw, keep, n, 1);
+            keep_col_blocks(&next->b, keep, n, 1);
+            keep_col_blocks(&next->db, keep, n, 1);
+            if(next->folded) prune_batchnorm_channels(next->folded, keep, n);
+            next->channels = next->filters = n;
+            reset_layer_state(next);
+            spatial = layer_outputs(*next, 0) / n;
+            continue;
+        }
+        if(next->type == CONVOLUTIONAL_LAYER || next->type == CONV1D_LAYER){
+            int k = next->w.cols / next->channels;
+            keep_col_blocks(&next->w, keep, n, k);
+            keep_col_blocks(&next->dw, keep, n, k);
+            next->channels = n;
+            reset_layer_state(next);
+        } else if(next->type == CONNECTED_LAYER){
+            keep_row_blocks(&next->w, keep, n, spatial);
+            keep_row_blocks(&next->dw, keep, n, spatial);
+            reset_layer_state(next);
+        }
+        break;
+    }
+    if(m->arena) pack_net(m);
+    return 0;
+}
+
+int compare_scores(const void *a, const void *b)
+{
+    float x = ((const float *)a)[0];
+    float y = ((const float *)b)[0];
+    if(x != y) return x < y ? 1 : -1;
+    // Ties keep the lower index first so ranking is stable
+    return ((const float *)a)[1] < ((const float *)b)[1] ? -1 : 1;
+}
+
+int compare_ints(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Prune the lowest scoring filters of a layer, see score_filters and
+// prune_filters
+// net *m: network to prune
+// int i: index of the layer to prune
+// float ratio: fraction of filters to remove, at least one is kept
+// PRUNE_CRITERION c: how to rank filters
+// returns: number of filters left, -1 if layer i can't be pruned
+int prune_layer(net *m, int i, float ratio, PRUNE_CRITERION c)
+{
+    layer l = m->layers[i];
+    int old = layer_filters(l);
+    if(!old || l.type == DEPTHWISE_LAYER) return -1;
+    int n = old - (int)(ratio*old);
+    if(n < 1) n = 1;
+
+    float *score = calloc(old, sizeof(float));
+    float *ranked = calloc(2*old, sizeof(float));
+    int *keep = calloc(old, sizeof(int));
+    int j;
+    if(score_filters(l, c, score)){
+        free(score);
+        free(ranked);
+        free(keep);
+        return -1;
+    }
+    for(j = 0; j < old; ++j){
+        ranked[2*j] = score[j];
+        ranked[2*j+1] = j;
+    }
+    qsort(ranked, old, 2*sizeof(float), compare_scores);
+    for(j = 0; j < n; ++j){
+        keep[j] = (int)ranked[2*j+1];
+    }
+    qsort(keep, n, sizeof(int), compare_ints);
+    int status = prune_filters(m, i, keep, n);
+    free(score);
+    free(ranked);
+    free(keep);
+    return status ? -1 : n;
+}
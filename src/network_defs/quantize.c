@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "uwnet.h"
+
+// Largest absolute value in a buffer
+float max_abs(const float *x, int n)
+{
+    int i;
+    float m = 0;
+    for(i = 0; i < n; ++i){
+        float v = fabsf(x[i]);
+        if(v > m) m = v;
+    }
+    return m;
+}
+
+// Choose the number of fractional bits for values in [-range, range] so
+// they fit a q7, the same rule the CMSIS-NN conversion scripts use
+// float range: largest absolute value to represent
+// returns: fractional bits, clamped to [-8, 15]
+int q_format(float range)
+{
+    if(range <= 0) return 7;
+    int q = 7 - (int)ceilf(log2f(range));
+    if(q < -8) q = -8;
+    if(q > 15) q = 15;
+    return q;
+}
+
+// Convert floats to q7 with q fractional bits, rounding and saturating
+void quantize_buffer(const float *x, int8_t *y, int n, int q)
+{
+    int i;
+    float s = ldexpf(1, q);
+    for(i = 0; i < n; ++i){
+        float v = roundf(x[i]*s);
+        if(v > 127) v = 127;
+        if(v < -128) v = -128;
+        y[i] = (int8_t)v;
+    }
+}
+
+// Convert q7 values with q fractional bits back to floats
+void dequantize_buffer(const int8_t *x, float *y, int n, int q)
+{
+    int i;
+    float s = ldexpf(1, -q);
+    for(i = 0; i < n; ++i){
+        y[i] = x[i]*s;
+    }
+}
+
+// Pick weight/bias formats and the shifts that tie them to the input and
+// output formats. Shifts are unsigned in the q7 kernels, so bias_q and
+// out_q give up precision when they would need a negative shift.
+void choose_shifts(qlayer *q, float wrange, float brange, float orange)
+{
+    q->weight_q = q_format(wrange);
+    q->bias_q = q_format(brange);
+    q->out_q = q_format(orange);
+    int acc_q = q->input_q + q->weight_q;
+    if(q->bias_q > acc_q) q->bias_q = acc_q;
+    if(q->out_q > acc_q) q->out_q = acc_q;
+    q->bias_lshift = acc_q - q->bias_q;
+    q->out_rshift = acc_q - q->out_q;
+}
+
+// Quantize a conv layer. Filters go from the float layout
+// [filter][channel][ky][kx] to the HWC layout [filter][ky][kx][channel].
+void quantize_convolutional_layer(layer l, qlayer *q, float orange)
+{
+    int f, c, i;
+    int k = l.size*l.size;
+    q->type = CONVOLUTIONAL_LAYER;
+    q->im_dim = l.width;
+    q->im_ch = l.channels;
+    q->ker_dim = l.size;
+    q->stride = l.stride;
+    q->out_dim = (l.width - l.size)/l.stride + 1;
+    q->outputs = l.filters;
+    q->inputs = l.channels*k;
+    choose_shifts(q, max_abs(l.w.data, l.w.rows*l.w.cols), max_abs(l.b.data, l.b.cols), orange);
+
+    float *hwc = calloc(l.w.rows*l.w.cols, sizeof(float));
+    for(f = 0; f < l.filters; ++f){
+        for(c = 0; c < l.channels; ++c){
+            for(i = 0; i < k; ++i){
+                hwc[(f*k + i)*l.channels + c] = l.w.data[(f*l.channels + c)*k + i];
+            }
+        }
+    }
+    q->nw = l.w.rows*l.w.cols;
+    q->w = calloc(q->nw, sizeof(int8_t));
+    quantize_buffer(hwc, q->w, q->nw, q->weight_q);
+    free(hwc);
+}
+
+// Reorder connected weights from [input][output] to [output][input], the
+// order the int8 fully connected kernels read. If the input comes from a
+// conv layer with in_ch channels, inputs are also reordered from CHW to
+// the HWC layout the int8 conv kernels produce.
+// float *t: room for l.w.rows*l.w.cols weights
+// int in_ch: channels of the conv output feeding l, 0 for a flat input
+void transpose_connected_weights(layer l, float *t, int in_ch)
+{
+    int i, j;
+    int spatial = (in_ch > 0 && l.w.rows % in_ch == 0) ? l.w.rows / in_ch : 0;
+    for(i = 0; i < l.w.rows; ++i){
+        // Index of float input i in the int8 input vector
+        int k = spatial ? (i % spatial)*in_ch + i/spatial : i;
+        for(j = 0; j < l.w.cols; ++j){
+            t[j*l.w.rows + k] = l.w.data[i*l.w.cols + j];
+        }
+    }
+}
+
+// Quantize a connected layer, see transpose_connected_weights
+void quantize_connected_layer(layer l, qlayer *q, float orange, int in_ch)
+{
+    q->type = CONNECTED_LAYER;
+    q->inputs = l.w.rows;
+    q->outputs = l.w.cols;
+    choose_shifts(q, max_abs(l.w.data, l.w.rows*l.w.cols), max_abs(l.b.data, l.b.cols), orange);
+
+    float *t = calloc(l.w.rows*l.w.cols, sizeof(float));
+    transpose_connected_weights(l, t, in_ch);
+    q->nw = l.w.rows*l.w.cols;
+    q->w = calloc(q->nw, sizeof(int8_t));
+    quantize_buffer(t, q->w, q->nw, q->weight_q);
+    free(t);
+}
+
+// Post-training quantization of a float net to the q7 CMSIS-NN format.
+// Activation ranges are measured by running calibration examples through
+// the net; each layer's input format is the previous layer's output format
+// so the int8 stages chain without requantizing. Batchnorm layers have to
+// be folded first, see fold_batchnorm_net. The q7 kernels have no
+// depthwise layer, nets with one go through the s8 stages instead.
+// net m: trained network
+// matrix calib: calibration inputs, one example per row
+// qlayer *q: receives one entry per conv/connected layer, room for m.n
+// returns: number of quantized layers, -1 if the net can't be quantized
+int quantize_net(net m, matrix calib, qlayer *q)
+{
+    int i;
+    int n = 0;
+    int c = 0;
+    int input_q = q_format(max_abs(calib.data, calib.rows*calib.cols));
+
+    for(i = 0; i < m.n; ++i){
+        LAYER_TYPE t = m.layers[i].type;
+        if(t != CONVOLUTIONAL_LAYER && t != CONNECTED_LAYER && t != ACTIVATION_LAYER) return -1;
+    }
+
+    matrix x = copy_matrix(calib);
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        l.inference = 1;
+        l.nosave = 1;
+        matrix y = l.forward(l, x);
+        if(l.type == CONVOLUTIONAL_LAYER || l.type == CONNECTED_LAYER){
+            qlayer *ql = &q[n++];
+            memset(ql, 0, sizeof(*ql));
+            ql->input_q = input_q;
+            float orange = max_abs(y.data, y.rows*y.cols);
+            if(l.type == CONVOLUTIONAL_LAYER){
+                quantize_convolutional_layer(l, ql, orange);
+                c = l.filters;
+            } else {
+                quantize_connected_layer(l, ql, orange, c);
+                c = 0;
+            }
+            ql->nb = l.b.cols;
+            ql->b = calloc(ql->nb, sizeof(int8_t));
+            quantize_buffer(l.b.data, ql->b, ql->nb, ql->bias_q);
+            input_q = ql->out_q;
+        }
+        if(y.data != x.data) free_matrix(x);
+        x = y;
+    }
+    free_matrix(x);
+    return n;
+}
+
+void free_qlayers(qlayer *q, int n)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        free(q[i].w);
+        free(q[i].b);
+        q[i].w = 0;
+        q[i].b = 0;
+    }
+}
+
+void write_q7_define(FILE *fp, char *name, char *suffix, int8_t *x, int n)
+{
+    int i;
+    fprintf(fp, "#define %s_%s {", name, suffix);
+    for(i = 0; i < n; ++i){
+        fprintf(fp, i ? ",%d" : "%d", x[i]);
+    }
+    fprintf(fp, "}\n#define %s_%s_SHAPE %d\n", name, suffix, n);
+}
+
+// Write quantized layers as headers in the style of weights.h and
+// parameters.h, e.g. CONV1_WT, CONV1_OUT_RSHIFT
+// qlayer *q: quantized layers from quantize_net
+// char **names: macro prefix for each layer
+// int n: number of layers
+// char *weights_file, *params_file: headers to write
+// returns: 0 on success, -1 if a file can't be written
+int save_quantized_headers(qlayer *q, char **names, int n, char *weights_file, char *params_file)
+{
+    int i;
+    FILE *fp = fopen(weights_file, "w");
+    if(!fp) return -1;
+    for(i = 0; i < n; ++i){
+        write_q7_define(fp, names[i], "WT", q[i].w, q[i].nw);
+        write_q7_define(fp, names[i], "BIAS", q[i].b, q[i].nb);
+    }
+    fclose(fp);
+
+    fp = fopen(params_file, "w");
+    if(!fp) return -1;
+    for(i = 0; i < n; ++i){
+        char *s = names[i];
+        if(q[i].type == CONVOLUTIONAL_LAYER){
+            fprintf(fp, "#define %s_IM_CH %d\n", s, q[i].im_ch);
+            fprintf(fp, "#define %s_OUT_CH %d\n", s, q[i].outputs);
+            fprintf(fp, "#define %s_KER_DIM %d\n", s, q[i].ker_dim);
+            fprintf(fp, "#define %s_PADDING 0\n", s);
+            fprintf(fp, "#define %s_STRIDE %d\n", s, q[i].stride);
+            fprintf(fp, "#define %s_IM_DIM %d\n", s, q[i].im_dim);
+            fprintf(fp, "#define %s_OUT_DIM %d\n", s, q[i].out_dim);
+        } else {
+            fprintf(fp, "#define %s_OUT %d\n", s, q[i].outputs);
+            fprintf(fp, "#define %s_DIM %d\n", s, q[i].inputs);
+        }
+    }
+    for(i = 0; i < n; ++i){
+        char *s = names[i];
+        fprintf(fp, "#define %s_BIAS_LSHIFT %d\n", s, q[i].bias_lshift);
+        fprintf(fp, "#define %s_OUT_RSHIFT %d\n", s, q[i].out_rshift);
+        fprintf(fp, "#define %s_WEIGHT_Q %d\n", s, q[i].weight_q);
+        fprintf(fp, "#define %s_BIAS_Q %d\n", s, q[i].bias_q);
+        fprintf(fp, "#define %s_INPUT_Q %d\n", s, q[i].input_q);
+        fprintf(fp, "#define %s_OUT_Q %d\n", s, q[i].out_q);
+    }
+    fclose(fp);
+    return 0;
+}
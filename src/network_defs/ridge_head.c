@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "uwnet.h"
+
+// Start empty sums for a ridge regression head
+// int inputs: number of features
+// int outputs: number of targets
+// returns: sums with an extra constant input for the bias
+ridge make_ridge(int inputs, int outputs)
+{
+    ridge r = {0};
+    r.xtx = make_matrix(inputs+1, inputs+1);
+    r.xty = make_matrix(inputs+1, outputs);
+    return r;
+}
+
+// Add a batch of features and targets to the sums, only the lower
+// triangle of x^T x is kept
+// ridge *r: sums to update
+// matrix x: batch x inputs features
+// matrix y: batch x outputs targets, e.g. one-hot labels
+void accumulate_ridge(ridge *r, matrix x, matrix y)
+{
+    int n = r->xtx.rows;
+    int outputs = r->xty.cols;
+    assert(x.cols == n-1 && y.cols == outputs && x.rows == y.rows);
+    int s, i, j;
+    for(s = 0; s < x.rows; ++s){
+        float *xs = x.data + s*x.cols;
+        float *ys = y.data + s*y.cols;
+        // The last row is the constant bias input
+        for(i = 0; i < n; ++i){
+            float xi = (i < n-1) ? xs[i] : 1;
+            float *row = r->xtx.data + i*n;
+            for(j = 0; j < i; ++j) row[j] += xi*xs[j];
+            row[i] += xi*xi;
+            float *t = r->xty.data + i*outputs;
+            for(j = 0; j < outputs; ++j) t[j] += xi*ys[j];
+        }
+    }
+    r->count += x.rows;
+}
+
+// Solve (x^T x + lambda * count * I) w = x^T y and write w and b into a
+// connected layer. The bias is not regularized. The sums are left as they
+// are, so more data can be added and the head solved again.
+// ridge *r: accumulated sums
+// float lambda: regularization per example
+// layer *l: connected layer with matching shape, marked dirty
+// returns: 0 on success, -1 if the system could not be factored
+int solve_ridge(ridge *r, float lambda, layer *l)
+{
+    int n = r->xtx.rows;
+    int outputs = r->xty.cols;
+    assert(l->w.rows == n-1 && l->w.cols == outputs);
+    int i;
+    matrix a = copy_matrix(r->xtx);
+    matrix w = copy_matrix(r->xty);
+    for(i = 0; i < n-1; ++i) a.data[i*n + i] += lambda*r->count;
+    int status = cholesky_matrix(a);
+    if(status == 0){
+        cholesky_solve(a, w);
+        memcpy(l->w.data, w.data, (n-1)*outputs*sizeof(float));
+        memcpy(l->b.data, w.data + (n-1)*outputs, outputs*sizeof(float));
+        l->dirty = 1;
+    }
+    free_matrix(a);
+    free_matrix(w);
+    return status;
+}
+
+void free_ridge(ridge r)
+{
+    free_matrix(r.xtx);
+    free_matrix(r.xty);
+}
+
+// Fit the last connected layer of a net in closed form: one inference
+// pass over the data through the layers before it, then a ridge solve.
+// Anything after the head, e.g. softmax, is left as it is, so with
+// one-hot labels the head regresses the logits onto the labels.
+// net m: network whose head is refit
+// data d: training examples
+// int batch: examples per forward pass
+// float lambda: regularization per example, see solve_ridge
+// returns: index of the refit layer, -1 if there is none or the solve failed
+int train_ridge_head(net m, data d, int batch, float lambda)
+{
+    int h;
+    for(h = m.n-1; h >= 0; --h){
+        if(m.layers[h].type == CONNECTED_LAYER) break;
+    }
+    if(h < 0) return -1;
+    layer *l = &m.layers[h];
+
+    net features = m;
+    features.n = h;
+    features.inference = 1;
+    ridge r = make_ridge(l->w.rows, l->w.cols);
+    int i;
+    for(i = 0; i < d.x.rows; i += batch){
+        int n = (d.x.rows - i < batch) ? d.x.rows - i : batch;
+        matrix x = view_matrix(d.x.data + i*d.x.cols, n, d.x.cols);
+        matrix y = view_matrix(d.y.data + i*d.y.cols, n, d.y.cols);
+        matrix f = forward_net(features, x);
+        accumulate_ridge(&r, f, y);
+        free_matrix(f);
+    }
+    int status = solve_ridge(&r, lambda, l);
+    free_ridge(r);
+    return status ? -1 : h;
+}
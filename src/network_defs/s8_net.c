@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "s8_net.h"
+
+// Split a real multiplier into the Q31 multiplier and power of two shift
+// the s8 kernels requantize with, m = multiplier * 2^(shift - 31)
+void quantize_multiplier(double m, int32_t *multiplier, int32_t *shift)
+{
+    if(m == 0){
+        *multiplier = 0;
+        *shift = 0;
+        return;
+    }
+    int e;
+    double q = frexp(m, &e);
+    int64_t fixed = (int64_t)llround(q*(1ll << 31));
+    if(fixed == (1ll << 31)){
+        fixed /= 2;
+        ++e;
+    }
+    *multiplier = (int32_t)fixed;
+    *shift = e;
+}
+
+void set_dims(cmsis_nn_dims *d, int n, int h, int w, int c)
+{
+    d->n = n;
+    d->h = h;
+    d->w = w;
+    d->c = c;
+}
+
+// Clamp range of an int8 output, relu just raises the floor to zero
+void set_activation(cmsis_nn_activation *a, int out_zero, int relu)
+{
+    a->min = relu ? out_zero : -128;
+    a->max = 127;
+}
+
+void make_s8_conv(s8_stage *s, int im_dim, int im_ch, int out_ch, int ker_dim, int padding, int stride, int out_dim)
+{
+    memset(s, 0, sizeof(*s));
+    s->type = S8_CONV;
+    set_dims(&s->input_dims, 1, im_dim, im_dim, im_ch);
+    set_dims(&s->filter_dims, out_ch, ker_dim, ker_dim, im_ch);
+    set_dims(&s->bias_dims, 1, 1, 1, out_ch);
+    set_dims(&s->output_dims, 1, out_dim, out_dim, out_ch);
+    s->conv_params.stride.w = s->conv_params.stride.h = stride;
+    s->conv_params.padding.w = s->conv_params.padding.h = padding;
+    s->conv_params.dilation.w = s->conv_params.dilation.h = 1;
+    s->channel_quant.multiplier = calloc(out_ch, sizeof(int32_t));
+    s->channel_quant.shift = calloc(out_ch, sizeof(int32_t));
+    s->b = calloc(out_ch, sizeof(int32_t));
+}
+
+void make_s8_fc(s8_stage *s, int dim, int out)
+{
+    memset(s, 0, sizeof(*s));
+    s->type = S8_FC;
+    set_dims(&s->input_dims, 1, 1, 1, dim);
+    set_dims(&s->filter_dims, dim, 1, 1, out);
+    set_dims(&s->bias_dims, 1, 1, 1, out);
+    set_dims(&s->output_dims, 1, 1, 1, out);
+    s->b = calloc(out, sizeof(int32_t));
+}
+
+// Convert a legacy q7 conv layer (weights.h/parameters.h constants) to an
+// s8 stage. A right shift by OUT_RSHIFT is multiplier 0.5 with shift
+// 1 - OUT_RSHIFT, zero points are 0 since q7 formats are symmetric.
+void make_s8_conv_from_q7(s8_stage *s, const int8_t *wt, const int8_t *bias,
+        int im_dim, int im_ch, int out_ch, int ker_dim, int padding, int stride, int out_dim,
+        int bias_lshift, int out_rshift, int relu)
+{
+    int i;
+    make_s8_conv(s, im_dim, im_ch, out_ch, ker_dim, padding, stride, out_dim);
+    s->w = wt;
+    for(i = 0; i < out_ch; ++i){
+        s->channel_quant.multiplier[i] = 1 << 30;
+        s->channel_quant.shift[i] = 1 - out_rshift;
+        s->b[i] = (int32_t)bias[i] * (1 << bias_lshift);
+    }
+    set_activation(&s->conv_params.activation, 0, relu);
+}
+
+// Convert a legacy q7 fully connected layer to an s8 stage
+void make_s8_fc_from_q7(s8_stage *s, const int8_t *wt, const int8_t *bias,
+        int dim, int out, int bias_lshift, int out_rshift, int relu)
+{
+    int i;
+    make_s8_fc(s, dim, out);
+    s->w = wt;
+    s->tensor_quant.multiplier = 1 << 30;
+    s->tensor_quant.shift = 1 - out_rshift;
+    for(i = 0; i < out; ++i){
+        s->b[i] = (int32_t)bias[i] * (1 << bias_lshift);
+    }
+    set_activation(&s->fc_params.activation, 0, relu);
+}
+
+// Quantize a float conv layer with one symmetric weight scale per filter.
+// Activations use real = scale * (q - zero).
+// float in_scale, out_scale: activation scales
+// int in_zero, out_zero: activation zero points
+// int relu: fuse a relu into the output clamp
+void make_s8_conv_from_layer(s8_stage *s, layer l, float in_scale, int in_zero,
+        float out_scale, int out_zero, int relu)
+{
+    int f, c, i;
+    int k = l.size*l.size;
+    int n = l.channels*k;
+    int out_dim = (l.width - l.size)/l.stride + 1;
+    make_s8_conv(s, l.width, l.channels, l.filters, l.size, 0, l.stride, out_dim);
+    s->owned_w = calloc(l.w.rows*l.w.cols, sizeof(int8_t));
+    s->w = s->owned_w;
+
+    float *hwc = calloc(n, sizeof(float));
+    for(f = 0; f < l.filters; ++f){
+        float *w = l.w.data + f*n;
+        float ws = max_abs(w, n)/127;
+        if(ws == 0) ws = 1;
+        // [channel][ky][kx] to [ky][kx][channel]
+        for(c = 0; c < l.channels; ++c){
+            for(i = 0; i < k; ++i){
+                hwc[i*l.channels + c] = w[c*k + i]/ws;
+            }
+        }
+        quantize_buffer(hwc, s->owned_w + f*n, n, 0);
+        s->b[f] = (int32_t)lroundf(l.b.data[f]/(in_scale*ws));
+        quantize_multiplier((double)in_scale*ws/out_scale,
+                &s->channel_quant.multiplier[f], &s->channel_quant.shift[f]);
+    }
+    free(hwc);
+
+    s->conv_params.input_offset = -in_zero;
+    s->conv_params.output_offset = out_zero;
+    set_activation(&s->conv_params.activation, out_zero, relu);
+}
+
+// Quantize a float connected layer with one symmetric weight scale, the
+// s8 fully connected kernel only takes per-tensor requantization. Inputs
+// coming from a conv stage are HWC, pass its channels as in_ch so the
+// weights are reordered to match, or 0 for a flat input.
+void make_s8_fc_from_layer(s8_stage *s, layer l, float in_scale, int in_zero,
+        float out_scale, int out_zero, int relu, int in_ch)
+{
+    int i;
+    int n = l.w.rows*l.w.cols;
+    make_s8_fc(s, l.w.rows, l.w.cols);
+    s->owned_w = calloc(n, sizeof(int8_t));
+    s->w = s->owned_w;
+
+    float ws = max_abs(l.w.data, n)/127;
+    if(ws == 0) ws = 1;
+    float *t = calloc(n, sizeof(float));
+    transpose_connected_weights(l, t, in_ch);
+    for(i = 0; i < n; ++i){
+        t[i] /= ws;
+    }
+    quantize_buffer(t, s->owned_w, n, 0);
+    free(t);
+    for(i = 0; i < l.w.cols; ++i){
+        s->b[i] = (int32_t)lroundf(l.b.data[i]/(in_scale*ws));
+    }
+    quantize_multiplier((double)in_scale*ws/out_scale,
+            &s->tensor_quant.multiplier, &s->tensor_quant.shift);
+
+    s->fc_params.input_offset = -in_zero;
+    s->fc_params.output_offset = out_zero;
+    set_activation(&s->fc_params.activation, out_zero, relu);
+}
+
+// Quantize a float depthwise layer with one symmetric weight scale per
+// channel, see make_s8_conv_from_layer. Filters are stored [ky][kx][channel].
+void make_s8_depthwise_from_layer(s8_stage *s, layer l, float in_scale, int in_zero,
+        float out_scale, int out_zero, int relu)
+{
+    int c, i;
+    int k = l.size*l.size;
+    int out_dim = (l.width - l.size)/l.stride + 1;
+    make_s8_conv(s, l.width, l.channels, l.channels, l.size, 0, l.stride, out_dim);
+    s->type = S8_DEPTHWISE;
+    set_dims(&s->filter_dims, 1, l.size, l.size, l.channels);
+    s->dw_conv_params.ch_mult = 1;
+    s->dw_conv_params.stride.w = s->dw_conv_params.stride.h = l.stride;
+    s->dw_conv_params.dilation.w = s->dw_conv_params.dilation.h = 1;
+    s->owned_w = calloc(l.w.rows*l.w.cols, sizeof(int8_t));
+    s->w = s->owned_w;
+
+    float *t = calloc(l.w.rows*l.w.cols, sizeof(float));
+    for(c = 0; c < l.channels; ++c){
+        float *w = l.w.data + c*k;
+        float ws = max_abs(w, k)/127;
+        if(ws == 0) ws = 1;
+        for(i = 0; i < k; ++i){
+            t[i*l.channels + c] = w[i]/ws;
+        }
+        s->b[c] = (int32_t)lroundf(l.b.data[c]/(in_scale*ws));
+        quantize_multiplier((double)in_scale*ws/out_scale,
+                &s->channel_quant.multiplier[c], &s->channel_quant.shift[c]);
+    }
+    quantize_buffer(t, s->owned_w, l.w.rows*l.w.cols, 0);
+    free(t);
+
+    s->dw_conv_params.input_offset = -in_zero;
+    s->dw_conv_params.output_offset = out_zero;
+    set_activation(&s->dw_conv_params.activation, out_zero, relu);
+}
+
+void make_s8_maxpool(s8_stage *s, int im_dim, int ch, int ker_dim, int padding, int stride, int out_dim)
+{
+    memset(s, 0, sizeof(*s));
+    s->type = S8_MAXPOOL;
+    set_dims(&s->input_dims, 1, im_dim, im_dim, ch);
+    set_dims(&s->filter_dims, 1, ker_dim, ker_dim, 1);
+    set_dims(&s->output_dims, 1, out_dim, out_dim, ch);
+    s->pool_params.stride.w = s->pool_params.stride.h = stride;
+    s->pool_params.padding.w = s->pool_params.padding.h = padding;
+    set_activation(&s->pool_params.activation, 0, 0);
+}
+
+int s8_stage_outputs(s8_stage *s)
+{
+    return s->output_dims.h*s->output_dims.w*s->output_dims.c;
+}
+
+// Scratch bytes the stage's kernel needs in its context
+int32_t s8_stage_buffer_size(s8_stage *s)
+{
+    if(s->type == S8_CONV) return arm_convolve_s8_get_buffer_size(&s->input_dims, &s->filter_dims);
+    if(s->type == S8_FC) return arm_fully_connected_s8_get_buffer_size(&s->filter_dims);
+    return 0;
+}
+
+// Run one stage on a single example
+// cmsis_nn_context *ctx: scratch of at least s8_stage_buffer_size bytes
+arm_cmsis_nn_status run_s8_stage(s8_stage *s, cmsis_nn_context *ctx, const int8_t *in, int8_t *out)
+{
+    if(s->type == S8_CONV){
+        return arm_convolve_s8(ctx, &s->conv_params, &s->channel_quant,
+                &s->input_dims, in, &s->filter_dims, s->w,
+                &s->bias_dims, s->b, &s->output_dims, out);
+    }
+    if(s->type == S8_DEPTHWISE){
+        return arm_depthwise_conv_s8(ctx, &s->dw_conv_params, &s->channel_quant,
+                &s->input_dims, in, &s->filter_dims, s->w,
+                &s->bias_dims, s->b, &s->output_dims, out);
+    }
+    if(s->type == S8_FC){
+        return arm_fully_connected_s8(ctx, &s->fc_params, &s->tensor_quant,
+                &s->input_dims, in, &s->filter_dims, s->w,
+                &s->bias_dims, s->b, &s->output_dims, out);
+    }
+    return arm_max_pool_s8(ctx, &s->pool_params, &s->input_dims, in,
+            &s->filter_dims, &s->output_dims, out);
+}
+
+// Allocate what run_s8_stages needs for a chain of stages once: CMSIS
+// scratch for the hungriest kernel and two ping-pong buffers sized for the
+// largest output
+void make_s8_buffers(s8_buffers *b, s8_stage *s, int n)
+{
+    int i;
+    int max = 0;
+    int32_t scratch = 0;
+    for(i = 0; i < n; ++i){
+        if(s8_stage_outputs(&s[i]) > max) max = s8_stage_outputs(&s[i]);
+        if(s8_stage_buffer_size(&s[i]) > scratch) scratch = s8_stage_buffer_size(&s[i]);
+    }
+    b->ctx.size = scratch;
+    b->ctx.buf = scratch ? malloc(scratch) : 0;
+    b->buf[0] = malloc(max ? max : 1);
+    b->buf[1] = malloc(max ? max : 1);
+}
+
+void free_s8_buffers(s8_buffers *b)
+{
+    free(b->ctx.buf);
+    free(b->buf[0]);
+    free(b->buf[1]);
+    memset(b, 0, sizeof(*b));
+}
+
+// Run a chain of stages on a single example, intermediate results go
+// through the ping-pong buffers
+// s8_buffers *b: buffers from make_s8_buffers for these stages
+// int8_t *out: room for the last stage's outputs
+arm_cmsis_nn_status run_s8_stages(s8_stage *s, int n, s8_buffers *b, const int8_t *in, int8_t *out)
+{
+    int i;
+    arm_cmsis_nn_status status = ARM_CMSIS_NN_SUCCESS;
+    const int8_t *x = in;
+    for(i = 0; i < n && status == ARM_CMSIS_NN_SUCCESS; ++i){
+        int8_t *y = (i == n-1) ? out : b->buf[i % 2];
+        status = run_s8_stage(&s[i], &b->ctx, x, y);
+        x = y;
+    }
+    return status;
+}
+
+void free_s8_stage(s8_stage *s)
+{
+    if(s->type == S8_CONV || s->type == S8_DEPTHWISE){
+        free(s->channel_quant.multiplier);
+        free(s->channel_quant.shift);
+    }
+    free(s->b);
+    free(s->owned_w);
+    memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,83 @@
+#ifndef S8_NET_H
+#define S8_NET_H
+
+// Int8 inference with the s8 CMSIS-NN kernels. Stages hold everything
+// a kernel call needs, so a network is just an array of them.
+
+#include <arm_nnfunctions.h>
+#include "uwnet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {S8_CONV, S8_FC, S8_MAXPOOL, S8_DEPTHWISE} S8_STAGE;
+
+typedef struct{
+    S8_STAGE type;
+    cmsis_nn_dims input_dims;
+    cmsis_nn_dims filter_dims;
+    cmsis_nn_dims bias_dims;
+    cmsis_nn_dims output_dims;
+    cmsis_nn_conv_params conv_params;
+    cmsis_nn_dw_conv_params dw_conv_params;
+    cmsis_nn_fc_params fc_params;
+    cmsis_nn_pool_params pool_params;
+    cmsis_nn_per_channel_quant_params channel_quant;   // conv, depthwise
+    cmsis_nn_per_tensor_quant_params tensor_quant;     // fc
+    const int8_t *w;
+    int32_t *b;
+    int8_t *owned_w;    // weights quantized by us, freed with the stage
+} s8_stage;
+
+void quantize_multiplier(double m, int32_t *multiplier, int32_t *shift);
+void make_s8_conv_from_q7(s8_stage *s, const int8_t *wt, const int8_t *bias,
+        int im_dim, int im_ch, int out_ch, int ker_dim, int padding, int stride, int out_dim,
+        int bias_lshift, int out_rshift, int relu);
+void make_s8_fc_from_q7(s8_stage *s, const int8_t *wt, const int8_t *bias,
+        int dim, int out, int bias_lshift, int out_rshift, int relu);
+void make_s8_conv_from_layer(s8_stage *s, layer l, float in_scale, int in_zero,
+        float out_scale, int out_zero, int relu);
+void make_s8_fc_from_layer(s8_stage *s, layer l, float in_scale, int in_zero,
+        float out_scale, int out_zero, int relu, int in_ch);
+void make_s8_depthwise_from_layer(s8_stage *s, layer l, float in_scale, int in_zero,
+        float out_scale, int out_zero, int relu);
+void make_s8_maxpool(s8_stage *s, int im_dim, int ch, int ker_dim, int padding, int stride, int out_dim);
+int s8_stage_outputs(s8_stage *s);
+int32_t s8_stage_buffer_size(s8_stage *s);
+arm_cmsis_nn_status run_s8_stage(s8_stage *s, cmsis_nn_context *ctx, const int8_t *in, int8_t *out);
+void free_s8_stage(s8_stage *s);
+
+// Scratch and intermediate buffers for running a chain of stages
+typedef struct{
+    cmsis_nn_context ctx;
+    int8_t *buf[2];
+} s8_buffers;
+
+void make_s8_buffers(s8_buffers *b, s8_stage *s, int n);
+void free_s8_buffers(s8_buffers *b);
+arm_cmsis_nn_status run_s8_stages(s8_stage *s, int n, s8_buffers *b, const int8_t *in, int8_t *out);
+
+// Int8 stages behind a float interface: inputs are quantized with
+// input_q fractional bits, outputs dequantized with out_q
+typedef struct{
+    s8_stage *stages;
+    int n;
+    int input_q;
+    int out_q;
+    int8_t *in;
+    int8_t *q;
+    float *hwc;
+    s8_buffers buffers;
+    int owned;      // stages are freed with the backbone
+} int8_backbone;
+
+void make_int8_backbone(int8_backbone *bb, s8_stage *stages, int n, int input_q, int out_q);
+void make_cifar_backbone(int8_backbone *bb);
+void free_int8_backbone(int8_backbone *bb);
+layer make_int8_layer(int8_backbone *bb);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
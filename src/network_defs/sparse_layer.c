@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "uwnet.h"
+
+// Sparse connected layers keep w transposed, one row per output, in CSR
+// form over blocks of 1 or 4 consecutive inputs. l.w and l.dw hold only
+// the stored values, 1 x nnz, so optimizers, packing and weight files
+// work on them like on any other layer. The index is saved with them and
+// load_weights resizes the layer to whatever pattern the file holds.
+
+// Run a sparse connected layer on input
+// layer l: layer to run
+// matrix x: input to layer
+// returns: the result of running the layer y = xw+b
+matrix forward_sparse_layer(layer l, matrix x)
+{
+    sparse_index *s = l.sparse;
+    assert(x.cols == s->inputs);
+    if(!l.nosave){
+        free_matrix(*l.x);
+        *l.x = copy_matrix(x);
+    }
+
+    matrix y = l.out ? view_matrix(l.out, x.rows, s->outputs) : make_matrix(x.rows, s->outputs);
+    const int *row_ptr = (const int *)s->row_ptr.data;
+    const int *col_idx = (const int *)s->col_idx.data;
+    int r, j, k;
+    for(r = 0; r < x.rows; ++r){
+        float *xr = x.data + r*x.cols;
+        float *yr = y.data + r*y.cols;
+        for(j = 0; j < s->outputs; ++j){
+            float sum = l.b.data[j];
+            const float *v = l.w.data + row_ptr[j]*s->block;
+            if(s->block == 4){
+                for(k = row_ptr[j]; k < row_ptr[j+1]; ++k, v += 4){
+                    const float *xp = xr + col_idx[k];
+                    sum += v[0]*xp[0] + v[1]*xp[1] + v[2]*xp[2] + v[3]*xp[3];
+                }
+            } else {
+                for(k = row_ptr[j]; k < row_ptr[j+1]; ++k, ++v){
+                    sum += *v * xr[col_idx[k]];
+                }
+            }
+            yr[j] = sum;
+        }
+    }
+    return y;
+}
+
+// Run a sparse connected layer backward, only stored weights get
+// gradients so the sparsity pattern stays fixed during training
+// layer l: layer to run
+// matrix dy: dL/dy for this layer
+// returns: dL/dx for this layer
+matrix backward_sparse_layer(layer l, matrix dy)
+{
+    sparse_index *s = l.sparse;
+    matrix x = *l.x;
+    matrix dx = {0};
+    if(l.freeze && l.skip_dx) return dx;
+    if(!l.skip_dx) dx = make_matrix(dy.rows, s->inputs);
+
+    const int *row_ptr = (const int *)s->row_ptr.data;
+    const int *col_idx = (const int *)s->col_idx.data;
+    int r, j, k, b;
+    for(r = 0; r < dy.rows; ++r){
+        float *xr = x.data + r*x.cols;
+        float *dyr = dy.data + r*dy.cols;
+        float *dxr = dx.data ? dx.data + r*dx.cols : 0;
+        for(j = 0; j < s->outputs; ++j){
+            float d = dyr[j];
+            if(!l.freeze) l.db.data[j] += d;
+            for(k = row_ptr[j]; k < row_ptr[j+1]; ++k){
+                int c = col_idx[k];
+                float *v = l.w.data + k*s->block;
+                float *dv = l.dw.data + k*s->block;
+                for(b = 0; b < s->block; ++b){
+                    if(!l.freeze) dv[b] += d*xr[c + b];
+                    if(dxr) dxr[c + b] += d*v[b];
+                }
+            }
+        }
+    }
+    return dx;
+}
+
+// Update sparse connected layer, see update_connected_layer
+void update_sparse_layer(layer l, optimizer *o)
+{
+    if(l.freeze) return;
+    update_matrix(o, l.w, l.dw, l.wstate, o->decay);
+    update_matrix(o, l.b, l.db, l.bstate, 0);
+}
+
+// Make a sparse connected layer with room for nblocks blocks
+// int freeze: 1 to leave out the gradient buffers, see freeze_layer
+layer alloc_sparse_layer(int inputs, int outputs, int block, int nblocks, int freeze)
+{
+    sparse_index *s = calloc(1, sizeof(sparse_index));
+    s->inputs = inputs;
+    s->outputs = outputs;
+    s->block = block;
+    s->row_ptr = make_matrix(1, outputs + 1);
+    s->col_idx = make_matrix(1, nblocks);
+
+    layer l = {0};
+    l.type = SPARSE_LAYER;
+    l.sparse = s;
+    l.w = make_matrix(1, nblocks*block);
+    l.b = make_matrix(1, outputs);
+    if(!freeze){
+        l.dw = make_matrix(1, nblocks*block);
+        l.db = make_matrix(1, outputs);
+    }
+    l.freeze = freeze;
+    l.x = calloc(1, sizeof(matrix));
+    l.forward  = forward_sparse_layer;
+    l.backward = backward_sparse_layer;
+    l.update   = update_sparse_layer;
+    return l;
+}
+
+// Make a sparse copy of a connected layer, dropping every block whose
+// weights are all at most threshold in magnitude
+// layer d: dense connected layer, left untouched
+// float threshold: largest magnitude treated as zero
+// int block: 1 for CSR, 4 for 1x4 blocks along the inputs, which falls
+//            back to 1 if the inputs don't divide into blocks
+// returns: sparse connected layer computing the same function
+layer make_sparse_layer(layer d, float threshold, int block)
+{
+    assert(d.type == CONNECTED_LAYER);
+    int inputs = d.w.rows;
+    int outputs = d.w.cols;
+    if(block != 4 || inputs % 4) block = 1;
+    int i, j, b;
+
+    int nblocks = 0;
+    for(j = 0; j < outputs; ++j){
+        for(i = 0; i < inputs; i += block){
+            for(b = 0; b < block; ++b){
+                if(fabsf(d.w.data[(i + b)*outputs + j]) > threshold) break;
+            }
+            if(b < block) ++nblocks;
+        }
+    }
+
+    layer l = alloc_sparse_layer(inputs, outputs, block, nblocks, d.freeze);
+    int *row_ptr = (int *)l.sparse->row_ptr.data;
+    int *col_idx = (int *)l.sparse->col_idx.data;
+    memcpy(l.b.data, d.b.data, outputs*sizeof(float));
+    int k = 0;
+    for(j = 0; j < outputs; ++j){
+        for(i = 0; i < inputs; i += block){
+            for(b = 0; b < block; ++b){
+                if(fabsf(d.w.data[(i + b)*outputs + j]) > threshold) break;
+            }
+            if(b == block) continue;
+            col_idx[k] = i;
+            for(b = 0; b < block; ++b){
+                l.w.data[k*block + b] = d.w.data[(i + b)*outputs + j];
+            }
+            ++k;
+        }
+        row_ptr[j+1] = k;
+    }
+    return l;
+}
+
+// Make a sparse connected layer with no stored weights yet, to be filled
+// by load_weights or map_weights on a device that never held the dense
+// layer
+// int inputs, outputs: shape of the dense layer it stands for
+// returns: sparse layer computing y = b until weights are loaded
+layer make_empty_sparse_layer(int inputs, int outputs)
+{
+    return alloc_sparse_layer(inputs, outputs, 1, 0, 0);
+}
+
+// Give a sparse layer room for a different number of blocks, dropping its
+// values, pattern and optimizer state. Used when loading weights.
+// layer *l: sparse layer, must own its w
+// int nblocks: blocks to hold
+// int block: 1 or 4
+// returns: 0 on success, -1 if w is a view into a packed net
+int resize_sparse_layer(layer *l, int nblocks, int block)
+{
+    sparse_index *s = l->sparse;
+    if(s->col_idx.cols == nblocks && s->block == block) return 0;
+    if(l->w.shallow || l->dw.shallow) return -1;
+    int n = nblocks*block;
+    int grads = l->dw.data != 0;
+    free_matrix(l->w);
+    free_matrix(l->dw);
+    free_matrix(s->col_idx);
+    l->w = make_matrix(1, n);
+    l->dw = grads ? make_matrix(1, n) : (matrix){0};
+    s->col_idx = make_matrix(1, nblocks);
+    memset(s->row_ptr.data, 0, s->row_ptr.cols*sizeof(int));
+    s->block = block;
+    free_optimizer_state(l->wstate);
+    l->wstate = 0;
+    l->dirty = 1;
+    return 0;
+}
+
+int compare_floats(const void *a, const void *b)
+{
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Magnitude prune a connected layer to a target sparsity and replace it
+// with its sparse form. With 1x4 blocks the block L1 norm is ranked, so
+// the sparsity is reached in whole blocks.
+// net *m: network to change, repacked if it was packed; only the new
+//         layer starts without optimizer state
+// int i: index of a connected layer
+// float sparsity: fraction of weights to remove, e.g. .9
+// int block: 1 or 4, see make_sparse_layer
+// returns: number of stored weights, -1 if layer i is not connected or
+//          has a batchnorm folded into it, which a sparse layer could not
+//          give back to unfold_batchnorm_net
+int sparsify_layer(net *m, int i, float sparsity, int block)
+{
+    layer d = m->layers[i];
+    if(d.type != CONNECTED_LAYER || d.folded) return -1;
+    int inputs = d.w.rows;
+    int outputs = d.w.cols;
+    if(block != 4 || inputs % 4) block = 1;
+    int nblocks = inputs*outputs/block;
+    int j, k, b;
+
+    // Score blocks by their mean magnitude, then zero the weakest ones
+    float *score = calloc(nblocks, sizeof(float));
+    for(j = 0; j < outputs; ++j){
+        for(k = 0; k < inputs/block; ++k){
+            float s = 0;
+            for(b = 0; b < block; ++b) s += fabsf(d.w.data[(k*block + b)*outputs + j]);
+            score[j*(inputs/block) + k] = s/block;
+        }
+    }
+    float *sorted = calloc(nblocks, sizeof(float));
+    memcpy(sorted, score, nblocks*sizeof(float));
+    qsort(sorted, nblocks, sizeof(float), compare_floats);
+    int cut = (int)(sparsity*nblocks);
+    float threshold = cut > 0 ? sorted[cut-1] : -1;
+    int dropped = 0;
+    for(j = 0; j < outputs; ++j){
+        for(k = 0; k < inputs/block; ++k){
+            if(score[j*(inputs/block) + k] > threshold || dropped == cut) continue;
+            for(b = 0; b < block; ++b) d.w.data[(k*block + b)*outputs + j] = 0;
+            ++dropped;
+        }
+    }
+    free(score);
+    free(sorted);
+
+    layer s = make_sparse_layer(d, 0, block);
+    s.dirty = 1;
+    free_layer(d);
+    m->layers[i] = s;
+    if(m->arena) pack_net(m);
+    return m->layers[i].w.cols;
+}
@@ -1,6 +1,7 @@
 // Include guards and C++ compatibility
 #ifndef UWNET_H
 #define UWNET_H
+#include <stdint.h>
 #include "../utils/image.h"
 #include "../matrix/matrix.h"
 // #include "arm_math.h"
@@ -14,7 +15,54 @@ extern "C" {
 // The kinds of activations our framework supports
 typedef enum{LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX} ACTIVATION;
 
+// The kinds of layers our framework supports
+typedef enum{CONNECTED_LAYER, CONVOLUTIONAL_LAYER, ACTIVATION_LAYER, BATCHNORM_LAYER, INT8_LAYER, DEPTHWISE_LAYER, CONV1D_LAYER, SPARSE_LAYER} LAYER_TYPE;
+
+// One bit per element, used by in-place activations to remember
+// which inputs were positive
+typedef struct bitmask{
+    int n;
+    unsigned char *bits;
+} bitmask;
+
+// The parameter update rules our framework supports
+typedef enum{SGD, ADAM, RMSPROP} OPTIMIZER;
+typedef enum{PRUNE_L1, PRUNE_L2, PRUNE_TAYLOR} PRUNE_CRITERION;
+
+typedef struct optimizer{
+    OPTIMIZER type;
+    float rate;
+    float momentum;     // SGD momentum
+    float decay;        // l2 regularization
+    float beta1, beta2; // Adam moment decays, RMSProp uses beta2
+    float eps;
+    float scale;        // scale applied to accumulated gradients, e.g. 1/batch
+    int half;           // keep Adam/RMSProp state in bfloat16
+    int t;              // step count, used for Adam bias correction
+} optimizer;
+
+// Per-parameter optimizer state, allocated on first use
+typedef struct optimizer_state{
+    OPTIMIZER type;
+    int n, half;
+    void *m;    // Adam first moment, RMSProp mean square
+    void *v;    // Adam second moment
+} optimizer_state;
+
+// Sparsity pattern of a sparse connected layer, w transposed in CSR form
+// over blocks of consecutive inputs, see sparse_layer.c. The index arrays
+// are int32 kept in 1 x n matrices so weight files and checkpoints can
+// store them like any other tensor.
+typedef struct{
+    int inputs;
+    int outputs;
+    int block;      // 1 or 4 inputs per stored block
+    matrix row_ptr; // outputs+1 offsets into col_idx, in blocks
+    matrix col_idx; // first input of each block
+} sparse_index;
+
 typedef struct layer {
+    LAYER_TYPE type;
     matrix *x;
 
     // Weights
@@ -25,39 +73,135 @@ typedef struct layer {
     matrix b;
     matrix db;
 
+    // Optimizer state for w and b
+    optimizer_state *wstate;
+    optimizer_state *bstate;
+
     int freeze;
+    // Set when parameters change, cleared once they are checkpointed
+    int dirty;
+    // Set by backward_net on its copy of the layer when nobody needs dL/dx
+    int skip_dx;
+    // Set by forward_net on its copy of the layer when running without
+    // gradients: save nothing for backward and write the output to out,
+    // which may be the input buffer for layers that work elementwise
+    int inference;
+    float *out;
+    // Set by forward_net/backward_net on their copy of the layer under
+    // activation checkpointing: nosave skips saving state for backward,
+    // recompute marks a second forward over the same batch
+    int nosave;
+    int recompute;
     // Image dimensions
     int width, height, channels;
     int size, stride, filters;
     
     ACTIVATION activation;
 
+    // In-place activations overwrite their input and only keep what
+    // backward needs: a bitmask for RELU/LRELU, the output for LOGISTIC
+    int inplace;
+    bitmask *mask;
+
     // Batch norm matrices
     // int batchnorm;
-    matrix x_norm;
+    // x_norm, batch_mean and batch_istd are cached by forward for backward
+    matrix *x_norm;
+    matrix batch_mean;
+    matrix batch_istd;
     matrix rolling_mean;
     matrix rolling_variance;
 
+    // Batchnorm layer folded into this layer's weights, see fold_batchnorm_net
+    struct layer *folded;
+
+    // Cached Winograd filters of a 3x3 stride 1 conv layer, empty when
+    // w changed since they were made
+    matrix *winograd;
+    // Cached filter spectra of a long-kernel 1-D conv layer, same rules
+    matrix *spectra;
+
+    sparse_index *sparse;
+
+    // Int8 stages an int8 layer runs, see int8_layer.c
+    void *int8;
+
     matrix  (*forward)  (struct layer, struct matrix);
     matrix  (*backward) (struct layer, struct matrix);
-    void   (*update)   (struct layer, float rate, float momentum, float decay);
+    void   (*update)   (struct layer, optimizer *o);
 } layer;
 
 layer make_connected_layer(int inputs, int outputs);
+layer make_depthwise_layer(int w, int h, int c, int size, int stride);
+layer make_conv1d_layer(int length, int c, int filters, int size);
+layer make_sparse_layer(layer d, float threshold, int block);
+layer make_empty_sparse_layer(int inputs, int outputs);
+int resize_sparse_layer(layer *l, int nblocks, int block);
+void invalidate_weight_caches(layer l);
 layer make_activation_layer(ACTIVATION activation);
+layer make_inplace_activation_layer(ACTIVATION activation);
 layer make_convolutional_layer(int w, int h, int c, int filters, int size, int stride);
+int set_winograd(layer *l, int on);
 layer make_maxpool_layer(int w, int h, int c, int size, int stride);
 layer make_batchnorm_layer(int groups);
 
 
+// Nets should start zeroed, e.g. net m = {0}, then set layers and n
 typedef struct {
     layer *layers;
     int n;
+
+    // Contiguous parameter and gradient storage owned by the net once
+    // pack_net is called. Layer w/b/dw/db become views into it; the first
+    // ndecay parameters get weight decay, the rest (biases, scales) don't.
+    void *arena;
+    float *params;
+    float *grads;
+    int nparams;
+    int ndecay;
+    // Optimizer state for the two regions, boxed so copies of the net share it
+    optimizer_state **state;
+
+    // Run forward_net without gradients, see forward_net_inference
+    int inference;
+
+    // Activation checkpointing, see plan_checkpoints. When set, forward_net
+    // only keeps the inputs of layers with checkpoint[i] (in saved[i]) and
+    // of the last segment; backward_net recomputes the layers in between.
+    int *checkpoint;
+    matrix *saved;
 } net;
 
 matrix forward_net(net m, matrix x);
+int layer_outputs(layer l, int inputs);
+int first_trainable_layer(net m);
 void backward_net(net m, matrix d);
 void update_net(net m, float rate, float momentum, float decay);
+void optimize_net(net m, optimizer *o);
+void ensure_net_optimizer_state(net m, optimizer o);
+int plan_checkpoints(net *m, int batch, int inputs, size_t budget);
+void set_checkpoints(net *m, int *checkpoint);
+void clear_checkpoints(net *m);
+int last_checkpoint(net m);
+int recompute_segment(net m, int i);
+void free_layer_state(layer l);
+void pack_net(net *m);
+void zero_net_gradients(net m);
+void file_error(char *filename);
+void save_weights(net m, char *filename);
+int load_weights(net m, char *filename);
+int map_weights(net m, const void *blob, size_t size, int verify);
+int mmap_weights(net m, char *filename);
+int layer_tensors(layer *l, matrix **t, int *kind);
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n);
+void save_weights_raw(net m, char *filename);
+void load_weights_raw(net m, char *filename);
+void save_parameters(net m, char *filename);
+int load_parameters(net m, char *filename);
+void fold_batchnorm_net(net *m);
+void unfold_batchnorm_net(net *m);
+void freeze_layer(layer *l);
+void unfreeze_layer(layer *l);
 void free_layer(layer l);
 void free_net(net n);
 
@@ -69,7 +213,115 @@ data random_batch(data d, int n);
 data load_image_classification_data(char *images, char *label_file);
 void free_data(data d);
 void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay);
+void train_image_classifier_opt(net m, data d, int batch, int iters, optimizer *o);
+void train_image_classifier_micro(net m, data d, int batch, int micro, int iters, optimizer *o);
 float accuracy_net(net m, data d);
+int train_ridge_head(net m, data d, int batch, float lambda);
+
+// Preallocated buffers for learning one example at a time, see online.c
+typedef struct {
+    net m;
+    optimizer *o;
+    int *size;      // n+1 activation sizes, size[0] is the input
+    float **act;    // n+1 activations, act[0] a copy of the input
+    float *grad[2]; // dL/dx, alternating between layers
+    int first;      // first trainable layer, backward stops there
+    long ops;       // multiply-adds and elementwise ops per learn_one
+} learner;
+
+int make_learner(learner *s, net m, int inputs, optimizer *o);
+float learn_one(learner *s, const float *x, int label);
+void free_learner(learner *s);
+
+optimizer make_sgd_optimizer(float rate, float momentum, float decay);
+optimizer make_adam_optimizer(float rate, float beta1, float beta2, float decay);
+optimizer make_rmsprop_optimizer(float rate, float alpha, float decay);
+void ensure_optimizer_state(optimizer_state **s, optimizer o, int n);
+void free_optimizer_state(optimizer_state *s);
+void update_matrix(optimizer *o, matrix w, matrix dw, optimizer_state *s, float decay);
+
+// Storage for incremental checkpoints, with flash semantics: erased bytes
+// read 0xff, writes are aligned to write_align and need erased space
+typedef struct checkpoint_store{
+    int (*read)(struct checkpoint_store *s, uint32_t offset, void *data, uint32_t size);
+    int (*write)(struct checkpoint_store *s, uint32_t offset, const void *data, uint32_t size);
+    int (*erase)(struct checkpoint_store *s, uint32_t offset, uint32_t size);
+    uint32_t size;
+    uint32_t erase_size;
+    uint32_t write_align;
+    void *ctx;
+} checkpoint_store;
+
+// Where each layer's live copy is, as stored in the commit record
+typedef struct{
+    uint32_t slot;
+    uint32_t bytes;
+    uint32_t crc;
+} checkpoint_entry;
+
+typedef struct{
+    checkpoint_store *store;
+    int n;                      // layers
+    uint32_t *slot_offset;      // first of two slots per layer
+    uint32_t *slot_size;
+    uint32_t sequence;
+    int record;                 // live commit record, -1 if none yet
+    checkpoint_entry *entries;
+} checkpoint;
+
+int open_checkpoint(checkpoint *c, checkpoint_store *s, net m);
+int save_checkpoint(checkpoint *c, net m);
+int restore_checkpoint(checkpoint *c, net m);
+void close_checkpoint(checkpoint *c);
+int open_file_store(checkpoint_store *s, char *filename, uint32_t size, uint32_t erase_size);
+void close_file_store(checkpoint_store *s);
+int open_flash_store(checkpoint_store *s, int area_id);
+
+// A conv or connected layer in the q7 CMSIS-NN format, see quantize_net.
+// Each *_q is a number of fractional bits, as in parameters.h
+typedef struct{
+    LAYER_TYPE type;
+    int inputs;
+    int outputs;
+    int im_dim, im_ch, ker_dim, stride, out_dim;
+    int weight_q, bias_q, input_q, out_q;
+    int bias_lshift;
+    int out_rshift;
+    int8_t *w;      // conv: [filter][ky][kx][channel], connected: [out][in]
+    int nw;
+    int8_t *b;
+    int nb;
+} qlayer;
+
+float max_abs(const float *x, int n);
+int q_format(float range);
+void quantize_buffer(const float *x, int8_t *y, int n, int q);
+void dequantize_buffer(const int8_t *x, float *y, int n, int q);
+void transpose_connected_weights(layer l, float *t, int in_ch);
+int quantize_net(net m, matrix calib, qlayer *q);
+void free_qlayers(qlayer *q, int n);
+int save_quantized_headers(qlayer *q, char **names, int n, char *weights_file, char *params_file);
+
+int compile_net(net m, int inputs, char *name, char *filename);
+int layer_filters(layer l);
+int score_filters(layer l, PRUNE_CRITERION c, float *score);
+int prune_filters(net *m, int i, const int *keep, int n);
+int prune_layer(net *m, int i, float ratio, PRUNE_CRITERION c);
+int sparsify_layer(net *m, int i, float sparsity, int block);
+int energy_rank(matrix s, float energy);
+int factorize_layer(net *m, int i, int rank, float energy);
+
+// Running sums for a closed form ridge regression head, see ridge_head.c
+typedef struct {
+    matrix xtx;
+    matrix xty;
+    int count;
+} ridge;
+
+ridge make_ridge(int inputs, int outputs);
+void accumulate_ridge(ridge *r, matrix x, matrix y);
+int solve_ridge(ridge *r, float lambda, layer *l);
+void free_ridge(ridge r);
 
 char *fgetl(FILE *fp);
 
@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "uwnet.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Weight file layout, all fields little-endian as on the host and target:
+//   weight_header
+//   weight_tensor[ntensors]
+//   tensor data, each tensor starting on a WEIGHT_ALIGN boundary
+// The CRC covers everything from data_offset to the end of the file.
+#define WEIGHT_MAGIC "MLWT"
+#define WEIGHT_VERSION 1
+#define WEIGHT_ALIGN 32
+
+typedef enum{TENSOR_W, TENSOR_B, TENSOR_ROLLING_MEAN, TENSOR_ROLLING_VARIANCE,
+    TENSOR_ROW_PTR, TENSOR_COL_IDX} TENSOR_KIND;
+typedef enum{DTYPE_F32, DTYPE_I32} TENSOR_DTYPE;
+
+typedef struct{
+    char magic[4];
+    uint16_t version;
+    uint16_t layers;
+    uint32_t ntensors;
+    uint32_t alignment;
+    uint32_t data_offset;
+    uint32_t data_size;
+    uint32_t crc;
+    uint32_t reserved;
+} weight_header;
+
+typedef struct{
+    uint16_t layer;
+    uint8_t layer_type;
+    uint8_t kind;
+    uint8_t dtype;
+    uint8_t pad[3];
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t offset;    // from data_offset
+} weight_tensor;
+
+// Standard reflected CRC-32, a nibble at a time to keep the table small
+uint32_t crc32_update(uint32_t crc, const void *data, size_t n)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    const uint8_t *p = data;
+    size_t i;
+    crc = ~crc;
+    for(i = 0; i < n; ++i){
+        crc = table[(crc ^ p[i]) & 0xf] ^ (crc >> 4);
+        crc = table[(crc ^ (p[i] >> 4)) & 0xf] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+// Pointers to the tensors of layer l in file order
+// matrix **t: filled with up to 4 tensors
+// int *kind: filled with their TENSOR_KIND
+// returns: number of tensors
+int layer_tensors(layer *l, matrix **t, int *kind)
+{
+    int n = 0;
+    if(l->sparse){
+        // Values, bias and the int32 index, even while still empty
+        t[n] = &l->w; kind[n++] = TENSOR_W;
+        t[n] = &l->b; kind[n++] = TENSOR_B;
+        t[n] = &l->sparse->row_ptr; kind[n++] = TENSOR_ROW_PTR;
+        t[n] = &l->sparse->col_idx; kind[n++] = TENSOR_COL_IDX;
+        return n;
+    }
+    if(l->w.data){ t[n] = &l->w; kind[n++] = TENSOR_W; }
+    if(l->b.data){ t[n] = &l->b; kind[n++] = TENSOR_B; }
+    if(l->rolling_mean.data){ t[n] = &l->rolling_mean; kind[n++] = TENSOR_ROLLING_MEAN; }
+    if(l->rolling_variance.data){ t[n] = &l->rolling_variance; kind[n++] = TENSOR_ROLLING_VARIANCE; }
+    return n;
+}
+
+uint32_t align_offset(uint32_t n)
+{
+    return (n + WEIGHT_ALIGN-1) / WEIGHT_ALIGN * WEIGHT_ALIGN;
+}
+
+// Build the tensor table for a net
+// returns: number of tensors, table and header filled in except the crc
+int weight_table(net m, weight_header *h, weight_tensor *table)
+{
+    int i, j;
+    int n = 0;
+    uint32_t offset = 0;
+    for(i = 0; i < m.n; ++i){
+        matrix *t[4];
+        int kind[4];
+        int k = layer_tensors(&m.layers[i], t, kind);
+        for(j = 0; j < k; ++j){
+            if(table){
+                weight_tensor e = {0};
+                e.layer = i;
+                e.layer_type = m.layers[i].type;
+                e.kind = kind[j];
+                e.dtype = (kind[j] == TENSOR_ROW_PTR || kind[j] == TENSOR_COL_IDX) ? DTYPE_I32 : DTYPE_F32;
+                e.rows = t[j]->rows;
+                e.cols = t[j]->cols;
+                e.offset = offset;
+                table[n] = e;
+            }
+            offset = align_offset(offset + t[j]->rows*t[j]->cols*sizeof(float));
+            ++n;
+        }
+    }
+    memset(h, 0, sizeof(weight_header));
+    memcpy(h->magic, WEIGHT_MAGIC, 4);
+    h->version = WEIGHT_VERSION;
+    h->layers = m.n;
+    h->ntensors = n;
+    h->alignment = WEIGHT_ALIGN;
+    h->data_offset = align_offset(sizeof(weight_header) + n*sizeof(weight_tensor));
+    h->data_size = offset;
+    return n;
+}
+
+// Write a net's weights, biases and batchnorm statistics with a header
+// describing every tensor and a CRC over the data
+void save_weights(net m, char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) file_error(filename);
+
+    weight_header h;
+    int n = weight_table(m, &h, 0);
+    weight_tensor *table = calloc(n ? n : 1, sizeof(weight_tensor));
+    weight_table(m, &h, table);
+
+    // Data padding is zero, so the CRC can be run tensor by tensor
+    static const char zeros[WEIGHT_ALIGN] = {0};
+    uint32_t crc = 0;
+    uint32_t written = 0;
+    int i, j, t = 0;
+    for(i = 0; i < m.n; ++i){
+        matrix *ts[4];
+        int kind[4];
+        int k = layer_tensors(&m.layers[i], ts, kind);
+        for(j = 0; j < k; ++j, ++t){
+            uint32_t pad = table[t].offset - written;
+            crc = crc32_update(crc, zeros, pad);
+            written += pad;
+            size_t bytes = ts[j]->rows*ts[j]->cols*sizeof(float);
+            crc = crc32_update(crc, ts[j]->data, bytes);
+            written += bytes;
+        }
+    }
+    crc = crc32_update(crc, zeros, h.data_size - written);
+    h.crc = crc;
+
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(table, sizeof(weight_tensor), n, fp);
+    fwrite(zeros, 1, h.data_offset - sizeof(h) - n*sizeof(weight_tensor), fp);
+    written = 0;
+    for(t = 0, i = 0; i < m.n; ++i){
+        matrix *ts[4];
+        int kind[4];
+        int k = layer_tensors(&m.layers[i], ts, kind);
+        for(j = 0; j < k; ++j, ++t){
+            fwrite(zeros, 1, table[t].offset - written, fp);
+            written = table[t].offset;
+            write_matrix(*ts[j], fp);
+            written += ts[j]->rows*ts[j]->cols*sizeof(float);
+        }
+    }
+    fwrite(zeros, 1, h.data_size - written, fp);
+    free(table);
+    fclose(fp);
+}
+
+// Check that a header and table describe exactly this net
+// returns: 0 if they match, -1 otherwise
+int check_weight_table(net m, weight_header *h, weight_tensor *table, size_t size)
+{
+    weight_header mh;
+    int n = weight_table(m, &mh, 0);
+    if(memcmp(h->magic, WEIGHT_MAGIC, 4) || h->version != WEIGHT_VERSION){
+        fprintf(stderr, "Not a weight file or unsupported version\n");
+        return -1;
+    }
+    if(h->layers != m.n || n < 0 || h->ntensors != (uint32_t)n || h->data_size != mh.data_size
+            || h->alignment != WEIGHT_ALIGN || h->data_offset != mh.data_offset
+            || (size_t)h->data_offset + h->data_size > size){
+        fprintf(stderr, "Weight file does not match the net\n");
+        return -1;
+    }
+    weight_tensor *mt = calloc(n ? n : 1, sizeof(weight_tensor));
+    weight_table(m, &mh, mt);
+    int i;
+    for(i = 0; i < n; ++i){
+        if(memcmp(&mt[i], &table[i], sizeof(weight_tensor))){
+            fprintf(stderr, "Weight file tensor %d (layer %d) does not match the net\n", i, table[i].layer);
+            free(mt);
+            return -1;
+        }
+    }
+    free(mt);
+    return 0;
+}
+
+// Number of blocks and block size a weight file holds for each sparse
+// layer, the layer's own where the file has nothing usable
+// int *nblocks, *block: filled for every layer of m
+void sparse_file_sizes(net m, weight_header *h, weight_tensor *table, int *nblocks, int *block)
+{
+    int i;
+    uint32_t t;
+    uint32_t values = 0;
+    for(i = 0; i < m.n; ++i){
+        sparse_index *s = m.layers[i].sparse;
+        nblocks[i] = s ? s->col_idx.cols : 0;
+        block[i] = s ? s->block : 0;
+    }
+    for(t = 0; t < h->ntensors; ++t){
+        weight_tensor e = table[t];
+        if(e.layer_type != SPARSE_LAYER || e.layer >= m.n || !m.layers[e.layer].sparse) continue;
+        // Values come before the index in every layer's tensors
+        if(e.kind == TENSOR_W) values = e.cols;
+        if(e.kind != TENSOR_COL_IDX) continue;
+        uint32_t n = e.cols;
+        uint32_t b = n ? values / n : (uint32_t)block[e.layer];
+        if((b != 1 && b != 4) || b*n != values) continue;
+        if((uint64_t)values*sizeof(float) > h->data_size) continue;
+        nblocks[e.layer] = n;
+        block[e.layer] = b;
+    }
+}
+
+// Check a weight file against the net as it will be once its sparse
+// layers are resized to the file, without changing the net
+// int *nblocks, *block: sizes from sparse_file_sizes
+// returns: 0 if they match, -1 otherwise
+int check_sparse_weight_table(net m, weight_header *h, weight_tensor *table, size_t size,
+        int *nblocks, int *block)
+{
+    int i;
+    int status = -1;
+    layer *layers = calloc(m.n ? m.n : 1, sizeof(layer));
+    sparse_index *index = calloc(m.n ? m.n : 1, sizeof(sparse_index));
+    memcpy(layers, m.layers, m.n*sizeof(layer));
+    for(i = 0; i < m.n; ++i){
+        layer *l = &layers[i];
+        if(!l->sparse) continue;
+        if(l->sparse->col_idx.cols == nblocks[i] && l->sparse->block == block[i]) continue;
+        if(l->w.shallow || l->dw.shallow){
+            fprintf(stderr, "Can't resize sparse layer %d of a packed net\n", i);
+            goto done;
+        }
+        // Only the shapes are read, the data stays the layer's own
+        index[i] = *l->sparse;
+        index[i].col_idx.cols = nblocks[i];
+        index[i].block = block[i];
+        l->sparse = &index[i];
+        l->w.rows = 1;
+        l->w.cols = nblocks[i]*block[i];
+    }
+    net f = m;
+    f.layers = layers;
+    status = check_weight_table(f, h, table, size);
+
+done:
+    free(index);
+    free(layers);
+    return status;
+}
+
+// Resize sparse layers to the sizes a checked weight file holds for them,
+// the pattern itself is loaded with the other tensors
+void fit_sparse_layers(net m, int *nblocks, int *block)
+{
+    int i;
+    for(i = 0; i < m.n; ++i){
+        if(m.layers[i].sparse) resize_sparse_layer(&m.layers[i], nblocks[i], block[i]);
+    }
+}
+
+// Load weights saved by save_weights, checking the architecture and CRC
+// before touching the net. Headerless files from save_weights_raw are
+// still accepted.
+// returns: 0 on success, -1 if the file does not fit the net
+int load_weights(net m, char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) file_error(filename);
+
+    weight_header h;
+    if(fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, WEIGHT_MAGIC, 4)){
+        fclose(fp);
+        load_weights_raw(m, filename);
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, sizeof(h), SEEK_SET);
+
+    int status = -1;
+    weight_tensor *table = calloc(h.ntensors ? h.ntensors : 1, sizeof(weight_tensor));
+    int *nblocks = calloc(m.n ? m.n : 1, sizeof(int));
+    int *block = calloc(m.n ? m.n : 1, sizeof(int));
+    char *data = 0;
+    if(h.ntensors > (uint32_t)size / sizeof(weight_tensor)) goto done;
+    if(fread(table, sizeof(weight_tensor), h.ntensors, fp) != h.ntensors) goto done;
+    sparse_file_sizes(m, &h, table, nblocks, block);
+    if(check_sparse_weight_table(m, &h, table, size, nblocks, block)) goto done;
+
+    // Stage the data so a bad CRC leaves the net untouched
+    data = malloc(h.data_size ? h.data_size : 1);
+    fseek(fp, h.data_offset, SEEK_SET);
+    if(fread(data, 1, h.data_size, fp) != h.data_size) goto done;
+    if(crc32_update(0, data, h.data_size) != h.crc){
+        fprintf(stderr, "Weight file %s is corrupted\n", filename);
+        goto done;
+    }
+    fit_sparse_layers(m, nblocks, block);
+
+    int i, j, t = 0;
+    for(i = 0; i < m.n; ++i){
+        matrix *ts[4];
+        int kind[4];
+        int k = layer_tensors(&m.layers[i], ts, kind);
+        for(j = 0; j < k; ++j, ++t){
+            memcpy(ts[j]->data, data + table[t].offset, ts[j]->rows*ts[j]->cols*sizeof(float));
+        }
+        m.layers[i].dirty = 1;
+        invalidate_weight_caches(m.layers[i]);
+    }
+    status = 0;
+
+done:
+    free(data);
+    free(block);
+    free(nblocks);
+    free(table);
+    fclose(fp);
+    return status;
+}
+
+// Point a net's tensors straight at a weight file image in memory, e.g.
+// a memory mapped file or a blob in execute-in-place flash, without copying.
+// The tensors are read-only afterwards unless the memory is writable.
+// const void *blob: file contents, aligned to at least 4 bytes
+// size_t size: size of blob
+// int verify: check the CRC first, costs one pass over the data
+// returns: 0 on success, -1 if the blob does not fit the net
+int map_weights(net m, const void *blob, size_t size, int verify)
+{
+    const char *base = blob;
+    const weight_header *h = blob;
+    if(size < sizeof(weight_header) || ((uintptr_t)blob & 3)) return -1;
+    if(h->ntensors > (size - sizeof(weight_header)) / sizeof(weight_tensor)) return -1;
+    weight_tensor *table = (weight_tensor *)(base + sizeof(weight_header));
+    weight_header hc = *h;
+    int *nblocks = calloc(m.n ? m.n : 1, sizeof(int));
+    int *block = calloc(m.n ? m.n : 1, sizeof(int));
+    sparse_file_sizes(m, &hc, table, nblocks, block);
+    int status = check_sparse_weight_table(m, &hc, table, size, nblocks, block);
+    if(!status && verify && crc32_update(0, base + h->data_offset, h->data_size) != h->crc){
+        fprintf(stderr, "Weight blob is corrupted\n");
+        status = -1;
+    }
+    if(!status) fit_sparse_layers(m, nblocks, block);
+    free(block);
+    free(nblocks);
+    if(status) return -1;
+
+    int i, j, t = 0;
+    for(i = 0; i < m.n; ++i){
+        matrix *ts[4];
+        int kind[4];
+        int k = layer_tensors(&m.layers[i], ts, kind);
+        for(j = 0; j < k; ++j, ++t){
+            float *p = (float *)(base + h->data_offset + table[t].offset);
+            free_matrix(*ts[j]);
+            *ts[j] = view_matrix(p, ts[j]->rows, ts[j]->cols);
+        }
+        m.layers[i].dirty = 1;
+        invalidate_weight_caches(m.layers[i]);
+    }
+    return 0;
+}
+
+#ifdef __linux__
+// Memory map a weight file and point the net at it. The mapping is private
+// so later training only copies the pages it touches; it stays mapped for
+// the rest of the process.
+// returns: 0 on success, -1 on failure
+int mmap_weights(net m, char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) file_error(filename);
+    struct stat st;
+    if(fstat(fd, &st)){
+        close(fd);
+        return -1;
+    }
+    void *blob = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(blob == MAP_FAILED) return -1;
+    if(map_weights(m, blob, st.st_size, 1)){
+        munmap(blob, st.st_size);
+        return -1;
+    }
+    return 0;
+}
+#else
+// No mmap on target, read the file instead
+int mmap_weights(net m, char *filename)
+{
+    return load_weights(m, filename);
+}
+#endif